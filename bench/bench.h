@@ -0,0 +1,146 @@
+#ifndef _BENCH_BENCH_H
+#define _BENCH_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Allocation counters. On glibc the benchmark binaries interpose malloc,
+ * calloc, realloc and free so every allocation in the process is counted,
+ * including the ones made by libcurl. Elsewhere they stay at zero.
+ */
+struct bench_allocs {
+    uint64_t count;
+    uint64_t bytes;
+};
+
+/**
+ * Zero the allocation counters.
+ */
+void bench_allocs_reset();
+
+/**
+ * @return allocations made since the last reset.
+ */
+struct bench_allocs bench_allocs_get();
+
+/**
+ * @param samples  latencies in nanoseconds, sorted in place.
+ * @param n        sample count
+ * @param p        percentile in [0, 100]
+ * @return         the sample at percentile 'p', zero if 'n' is zero.
+ */
+uint64_t bench_percentile(uint64_t* samples, size_t n, double p);
+
+/**
+ * Print one JSON result object, comma separated from the previous one.
+ *
+ * @param out     stream
+ * @param first   'true' for the first result of the array
+ * @param name    scenario name
+ * @param threads caller threads
+ * @param ops     operations performed
+ * @param ns      wall time of the run in nanoseconds
+ * @param samples per operation latencies in nanoseconds, sorted in place.
+ *                NULL to omit the latency fields.
+ * @param allocs  allocations made during the run
+ * @param extra   additional '"key": value' pairs, can be NULL.
+ */
+void bench_report(FILE* out, bool first, const char* name, int threads, uint64_t ops,
+                  uint64_t ns, uint64_t* samples, struct bench_allocs allocs, const char* extra);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(_UTILS_IMPL) || defined(_BENCH_IMPL)
+
+#include <stdlib.h>
+
+static uint64_t bench_alloc_count;
+static uint64_t bench_alloc_bytes;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static void bench_count(size_t size) {
+    __atomic_fetch_add(&bench_alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bench_alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    bench_count(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    bench_count(n * size);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    bench_count(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+#endif
+
+void bench_allocs_reset() {
+    __atomic_store_n(&bench_alloc_count, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&bench_alloc_bytes, 0, __ATOMIC_SEQ_CST);
+}
+
+struct bench_allocs bench_allocs_get() {
+    struct bench_allocs allocs;
+    allocs.count = __atomic_load_n(&bench_alloc_count, __ATOMIC_SEQ_CST);
+    allocs.bytes = __atomic_load_n(&bench_alloc_bytes, __ATOMIC_SEQ_CST);
+    return allocs;
+}
+
+static int bench_cmp(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+uint64_t bench_percentile(uint64_t* samples, size_t n, double p) {
+    if (n == 0) return 0;
+    qsort(samples, n, sizeof(uint64_t), bench_cmp);
+    size_t idx = (size_t) (p / 100.0 * (double) (n - 1) + 0.5);
+    return samples[idx < n ? idx : n - 1];
+}
+
+void bench_report(FILE* out, bool first, const char* name, int threads, uint64_t ops,
+                  uint64_t ns, uint64_t* samples, struct bench_allocs allocs, const char* extra) {
+    double seconds = (double) ns / 1e9;
+    fprintf(out, "%s\n    {\"scenario\": \"%s\", \"threads\": %d, \"ops\": %llu, \"seconds\": %.6f, "
+                 "\"ops_per_sec\": %.1f, \"ns_per_op\": %.1f",
+            first ? "" : ",", name, threads, (unsigned long long) ops, seconds,
+            seconds > 0 ? (double) ops / seconds : 0.0, ops ? (double) ns / (double) ops : 0.0);
+    if (samples) {
+        fprintf(out, ", \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f",
+                bench_percentile(samples, ops, 50.0) / 1e3,
+                bench_percentile(samples, ops, 99.0) / 1e3,
+                bench_percentile(samples, ops, 99.9) / 1e3);
+    }
+    fprintf(out, ", \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f%s%s}",
+            ops ? (double) allocs.count / (double) ops : 0.0,
+            ops ? (double) allocs.bytes / (double) ops : 0.0,
+            extra ? ", " : "", extra ? extra : "");
+}
+
+#endif
+#endif
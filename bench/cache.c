@@ -0,0 +1,220 @@
+#define _UTILS_IMPL
+#include <OAuth.h>
+#include <bench.h>
+#include <cache.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stress test and thread scaling benchmark of the sharded response cache.
+//
+// usage: cache [ops] [threads]
+//   ops      operations per thread, default 200000
+//   threads  largest thread count of the scaling runs, default 32
+//
+// The stress runs, two per eviction policy with and without a byte budget, mix
+// readers and writers over a key set four times larger than the cache and
+// check every value they read back along with the size and byte limits.
+// They exit with status 1 on any violation so they can gate a build. The scaling runs compare pure
+// lookups (hits/N), 5% writes (sharded/N) and the same mix on one locked map
+// (single_lock/N).
+
+#define KEYS 8192
+#define STRESS_SIZE (KEYS / 4)
+#define STRESS_BYTES (STRESS_SIZE * 128)
+#define SCALING_SIZE (KEYS * 2)
+#define PUT_PERCENT 5
+
+// single lock baseline, the map the cache replaced
+map_dec_strkey(response, const char*, response_data)
+map_def_strkey(response, const char*, response_data, cmp_str, murmurhash, {.data = 0})
+
+struct worker {
+    struct cache* cache;
+    struct map_response* map;   // single lock baseline when set
+    struct mutex* mtx;
+    char** keys;
+    uint64_t ops;
+    uint64_t seed;
+    uint32_t put_percent;
+    bool writer;
+    uint64_t hits;
+    uint64_t violations;
+};
+
+static uint64_t next_rand(uint64_t* x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static response_data value_of(char** keys, uint32_t i) {
+    return (response_data) {.data = keys[i], .content_type = "application/json", .response_code = i};
+}
+
+static void* stress_worker(void* arg) {
+    struct worker* w = (struct worker*) arg;
+    response_data value;
+
+    for (uint64_t i = 0; i < w->ops; i++) {
+        uint32_t k = (uint32_t) (next_rand(&w->seed) % KEYS);
+        if (w->writer) {
+            cache_put(w->cache, w->keys[k], value_of(w->keys, k));
+            continue;
+        }
+
+        // bodies are interned, only a copy can be compared once the lookup returned
+        bool copy = !(i & 1);
+        bool found = copy ? cache_get_copy(w->cache, cache_key_of(w->keys[k]), &value)
+                          : cache_peek(w->cache, w->keys[k], &value);
+        if (!found) continue;
+        w->hits++;
+        if (value.response_code != k || (copy && strcmp(value.data, w->keys[k]) != 0))
+            w->violations++;
+        if (copy) {
+            free((char*) value.data);
+            free((char*) value.content_type);
+        }
+    } return NULL;
+}
+
+static void* scaling_worker(void* arg) {
+    struct worker* w = (struct worker*) arg;
+    response_data value;
+
+    for (uint64_t i = 0; i < w->ops; i++) {
+        uint64_t r = next_rand(&w->seed);
+        uint32_t k = (uint32_t) (r % KEYS);
+        bool put = (r >> 32) % 100 < w->put_percent;
+
+        if (w->map) {
+            mutex_lock(w->mtx);
+            if (put) map_put_response(w->map, w->keys[k], value_of(w->keys, k));
+            else value = map_get_response(w->map, w->keys[k]);
+            mutex_unlock(w->mtx);
+        } else if (put) cache_put(w->cache, w->keys[k], value_of(w->keys, k));
+        else cache_get(w->cache, w->keys[k], &value);
+        w->hits += !put && value.data;
+    } return NULL;
+}
+
+static uint64_t run(struct worker* workers, int threads, void* (*fn)(void*)) {
+    struct thread* th = calloc(threads, sizeof(struct thread));
+    uint64_t start = time_mono_ns();
+    for (int i = 0; i < threads; i++) {
+        thread_init(&th[i]);
+        thread_start(&th[i], fn, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++)
+        thread_join(&th[i], NULL);
+    free(th);
+    return time_mono_ns() - start;
+}
+
+static bool stress(char** keys, uint64_t ops, int threads, POLICY policy, uint64_t max_bytes, bool first) {
+    struct cache cache;
+    struct worker* workers = calloc(threads, sizeof(struct worker));
+    char label[64];
+    cache_init(&cache, STRESS_SIZE, policy);
+    cache_set_max_bytes(&cache, max_bytes, 0);
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (struct worker) {
+            .cache = &cache, .keys = keys, .ops = ops, .seed = 0x9E3779B97F4A7C15ull * (i + 1), .writer = i % 2
+        };
+    }
+
+    uint64_t ns = run(workers, threads, stress_worker);
+    uint64_t hits = 0, violations = 0;
+    for (int i = 0; i < threads; i++) {
+        hits += workers[i].hits;
+        violations += workers[i].violations;
+    }
+
+    // every shard is capped at its share of the total
+    uint32_t size = cache_size(&cache);
+    uint32_t limit = (STRESS_SIZE + CACHE_SHARDS - 1) / CACHE_SHARDS * CACHE_SHARDS;
+    violations += size > limit;
+    uint64_t bytes = cache_bytes(&cache);
+    violations += max_bytes && bytes > (max_bytes + CACHE_SHARDS - 1) / CACHE_SHARDS * CACHE_SHARDS;
+
+    char extra[160];
+    snprintf(extra, sizeof(extra), "\"read_hits\": %llu, \"entries\": %u, \"bytes\": %llu, \"violations\": %llu",
+             (unsigned long long) hits, size, (unsigned long long) bytes, (unsigned long long) violations);
+    snprintf(label, sizeof(label), "stress/%s%s", POLICY_STRING[policy], max_bytes ? "/bytes" : "");
+    bench_report(stdout, first, label, threads, ops * threads, ns, NULL, (struct bench_allocs) {0}, extra);
+
+    cache_term(&cache);
+    free(workers);
+    return violations == 0;
+}
+
+static void scaling(const char* name, char** keys, uint64_t ops, int threads, bool single_lock, uint32_t put_percent) {
+    struct cache cache;
+    struct map_response map;
+    struct mutex mtx;
+    struct worker* workers = calloc(threads, sizeof(struct worker));
+    char label[64];
+
+    cache_init(&cache, SCALING_SIZE, POLICY_CLOCK);
+    map_init_response(&map, 0, 0);
+    map_set_circular(&map, true);
+    map_set_refresh(&map, true);
+    map_set_max_size(&map, SCALING_SIZE);
+    mutex_init(&mtx);
+
+    // warm so reads hit like the production workload
+    for (uint32_t k = 0; k < KEYS; k++) {
+        if (single_lock) map_put_response(&map, keys[k], value_of(keys, k));
+        else cache_put(&cache, keys[k], value_of(keys, k));
+    }
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (struct worker) {
+            .cache = &cache, .map = single_lock ? &map : NULL, .mtx = &mtx,
+            .keys = keys, .ops = ops, .seed = 0x9E3779B97F4A7C15ull * (i + 1), .put_percent = put_percent
+        };
+    }
+
+    uint64_t ns = run(workers, threads, scaling_worker);
+    snprintf(label, sizeof(label), "%s/%d", name, threads);
+    bench_report(stdout, false, label, threads, ops * threads, ns, NULL, (struct bench_allocs) {0}, NULL);
+
+    cache_term(&cache);
+    map_term_response(&map);
+    mutex_term(&mtx);
+    free(workers);
+}
+
+int main(int argc, char** argv) {
+    uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 32;
+    if (ops == 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [ops] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    char** keys = malloc(KEYS * sizeof(char*));
+    for (uint32_t i = 0; i < KEYS; i++)
+        keys[i] = str_create_fmt("/GET/https://api.myanimelist.net/v2/anime/%u?fields=id,title", i);
+
+    printf("{\"benchmark\": \"cache\", \"results\": [");
+    bool ok = true;
+    for (int policy = 0; policy < NUM_POLICIES; policy++) {
+        ok &= stress(keys, ops, 16, policy, 0, policy == 0);
+        ok &= stress(keys, ops, 16, policy, STRESS_BYTES, false);
+    }
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        scaling("hits", keys, ops, threads, false, 0);
+        scaling("sharded", keys, ops, threads, false, PUT_PERCENT);
+        scaling("single_lock", keys, ops, threads, true, PUT_PERCENT);
+    }
+    printf("\n]}\n");
+
+    for (uint32_t i = 0; i < KEYS; i++)
+        str_destroy(&keys[i]);
+    free(keys);
+    return ok ? 0 : 1;
+}
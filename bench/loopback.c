@@ -0,0 +1,34 @@
+#define _UTILS_IMPL
+#include <server.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Standalone loopback server with the canned routes used by the benchmarks.
+// Runs until stdin is closed.
+int main(int argc, char** argv) {
+    struct server s = {0};
+    uint16_t port = argc > 1 ? (uint16_t) strtoul(argv[1], NULL, 10) : 8080;
+
+    server_route(&s, (struct server_route) {.path = "/json", .body = "{\"id\":1,\"title\":\"loopback\"}"});
+    server_route(&s, (struct server_route) {.path = "/slow", .body = "{\"slow\":true}", .latency_ms = 200});
+    server_route(&s, (struct server_route) {.path = "/chunked", .body = "{\"chunked\":\"0123456789abcdef0123456789abcdef\"}", .chunk_size = 8, .chunk_delay_ms = 5});
+    server_route(&s, (struct server_route) {.path = "/not-modified", .status = 304});
+    server_route(&s, (struct server_route) {.path = "/throttled", .status = 429, .headers = "Retry-After: 1\r\n", .body = "{\"error\":\"throttled\"}"});
+    server_route(&s, (struct server_route) {.path = "/error", .status = 500, .body = "{\"error\":\"internal\"}"});
+    server_route(&s, (struct server_route) {.path = "/unavailable", .status = 503, .body = "{\"error\":\"unavailable\"}"});
+    server_route(&s, (struct server_route) {.path = "/oauth/token", .token = true});
+
+    if (!server_start(&s, port)) {
+        fprintf(stderr, "could not listen on 127.0.0.1:%u\n", (unsigned) port);
+        return 1;
+    }
+
+    printf("listening on http://127.0.0.1:%u\n", (unsigned) s.port);
+    fflush(stdout);
+    while (getchar() != EOF);
+
+    server_stop(&s);
+    printf("served %llu requests\n", (unsigned long long) s.requests);
+    return 0;
+}
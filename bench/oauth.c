@@ -0,0 +1,181 @@
+#define _UTILS_IMPL
+#include <OAuth.h>
+#include <bench.h>
+#include <server.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// End to end benchmark of oauth_request against the loopback server.
+//
+// usage: oauth [ops] [threads]
+//   ops      network requests per scenario, cache hits run 10x as many
+//   threads  caller threads of the multi threaded scenario
+
+#define BENCH_BODY \
+    "{\"data\":[{\"node\":{\"id\":5114,\"title\":\"Fullmetal Alchemist: Brotherhood\"," \
+    "\"main_picture\":{\"medium\":\"https://cdn.myanimelist.net/images/anime/1223/96541.jpg\"," \
+    "\"large\":\"https://cdn.myanimelist.net/images/anime/1223/96541l.jpg\"}}}," \
+    "{\"node\":{\"id\":9253,\"title\":\"Steins;Gate\",\"main_picture\":{" \
+    "\"medium\":\"https://cdn.myanimelist.net/images/anime/5/73199.jpg\"," \
+    "\"large\":\"https://cdn.myanimelist.net/images/anime/5/73199l.jpg\"}}}," \
+    "{\"node\":{\"id\":28977,\"title\":\"Gintama\xc2\xb0\",\"main_picture\":{" \
+    "\"medium\":\"https://cdn.myanimelist.net/images/anime/3/72078.jpg\"," \
+    "\"large\":\"https://cdn.myanimelist.net/images/anime/3/72078l.jpg\"}}}]," \
+    "\"paging\":{\"next\":\"https://api.myanimelist.net/v2/anime?offset=3&q=one&limit=3\"}}"
+
+struct scenario {
+    const char* name;
+    uint8_t options;
+    int threads;    // zero uses the threads argument
+    uint64_t scale; // ops multiplier
+    bool unique;    // new params on every request so every lookup misses
+    bool worker;    // run the stale refresh worker
+    bool prime;     // warm the cache before measuring
+};
+
+static const struct scenario scenarios[] = {
+    {"cache_hit",     REQUEST_CACHE, 1, 10, false, false, true},
+    {"cache_miss",    REQUEST_CACHE, 1, 1,  true,  false, false},
+    {"stale_refresh", REQUEST_CACHE, 1, 10, false, true,  true},
+    {"async",         REQUEST_ASYNC, 1, 1,  false, false, false},
+    {"async_mt",      REQUEST_ASYNC, 0, 1,  false, false, false}
+};
+
+struct caller {
+    OAuth* oauth;
+    const char* url;
+    uint8_t options;
+    bool unique;
+    uint64_t base;
+    uint64_t ops;
+    uint64_t* samples;
+    uint64_t failed;
+};
+
+static void* bench_caller(void* arg) {
+    struct caller* c = (struct caller*) arg;
+    char param[32];
+
+    for (uint64_t i = 0; i < c->ops; i++) {
+        uint64_t start = time_mono_ns();
+        if (c->unique) {
+            snprintf(param, sizeof(param), "%llu", (unsigned long long) (c->base + i));
+            oauth_append_data(c->oauth, "offset", param);
+        }
+        oauth_set_options(c->oauth, c->options);
+        response_data response = oauth_request(c->oauth, GET, c->url);
+        c->samples[i] = time_mono_ns() - start;
+
+        if (!response.data) c->failed++;
+        free((char*) response.data);
+        free((char*) response.content_type);
+    } return NULL;
+}
+
+// Returns 'false' when a scenario did not exercise what it measures
+static bool bench_scenario(struct server* s, const struct scenario* sc, uint64_t ops, int threads, bool first) {
+    char* url = server_url(s, "/json");
+    OAuth* oauth = oauth_create(NULL);
+    oauth_set_param(oauth, REQUEST_TIMEOUT, "0");
+
+    threads = sc->threads ? sc->threads : threads;
+    ops = ops * sc->scale / threads * threads;
+
+    uint64_t* samples = malloc(ops * sizeof(uint64_t));
+    struct caller* callers = calloc(threads, sizeof(struct caller));
+    struct thread* th = calloc(threads, sizeof(struct thread));
+
+    if (sc->prime) {
+        oauth_set_options(oauth, sc->options);
+        response_data response = oauth_request(oauth, GET, url);
+        free((char*) response.data);
+        free((char*) response.content_type);
+    }
+    if (sc->worker) {
+        // older than every refresh the hits queue, so none of them is skipped
+        time_sleep(2);
+        oauth_start_request_thread(oauth);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        callers[i] = (struct caller) {
+            .oauth = oauth, .url = url, .options = sc->options, .unique = sc->unique,
+            .base = i * (ops / threads), .ops = ops / threads, .samples = samples + i * (ops / threads)
+        };
+    }
+
+    uint64_t upstream = server_hits(s, "/json");
+    bench_allocs_reset();
+    uint64_t start = time_mono_ns();
+    if (threads == 1) bench_caller(&callers[0]);
+    else {
+        for (int i = 0; i < threads; i++) {
+            thread_init(&th[i]);
+            thread_start(&th[i], bench_caller, &callers[i]);
+        }
+        for (int i = 0; i < threads; i++)
+            thread_join(&th[i], NULL);
+    }
+    uint64_t elapsed = time_mono_ns() - start;
+    struct bench_allocs allocs = bench_allocs_get();
+
+    // the refreshes queued by the hits may still be in flight
+    for (int i = 0; sc->worker && i < 1000 && server_hits(s, "/json") == upstream; i++)
+        time_sleep(1);
+    upstream = server_hits(s, "/json") - upstream;
+    if (sc->worker) oauth_stop_request_thread(oauth);
+
+    uint64_t failed = 0;
+    for (int i = 0; i < threads; i++)
+        failed += callers[i].failed;
+
+    oauth_stats stats;
+    oauth_get_stats(oauth, &stats);
+    uint64_t lookups = stats.counters[CACHE_HITS] + stats.counters[CACHE_MISSES];
+
+    char extra[256];
+    snprintf(extra, sizeof(extra), "\"upstream_requests\": %llu, \"queue_skipped\": %llu, \"failed\": %llu, "
+             "\"cache_hit_ratio\": %.3f, \"bytes_in\": %llu",
+             (unsigned long long) upstream, (unsigned long long) stats.counters[QUEUE_SKIPPED],
+             (unsigned long long) failed, lookups ? (double) stats.counters[CACHE_HITS] / (double) lookups : 0.0,
+             (unsigned long long) stats.counters[BYTES_IN]);
+    bench_report(stdout, first, sc->name, threads, ops, elapsed, samples, allocs, extra);
+
+    oauth_delete(oauth);
+    free(samples);
+    free(callers);
+    free(th);
+    str_destroy(&url);
+
+    if (sc->worker && upstream == 0) {
+        fprintf(stderr, "%s: the refresh worker never reached upstream\n", sc->name);
+        return false;
+    } return true;
+}
+
+int main(int argc, char** argv) {
+    uint64_t ops = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000;
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    struct server s = {0};
+
+    if (ops == 0 || threads <= 0) {
+        fprintf(stderr, "usage: %s [ops] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    server_route(&s, (struct server_route) {.path = "/json", .body = BENCH_BODY});
+    if (!server_start(&s, 0)) {
+        fprintf(stderr, "could not start the loopback server\n");
+        return 1;
+    }
+
+    bool ok = true;
+    printf("{\"benchmark\": \"oauth_request\", \"results\": [");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        ok = bench_scenario(&s, &scenarios[i], ops, threads, i == 0) && ok;
+    printf("\n]}\n");
+
+    server_stop(&s);
+    return ok ? 0 : 1;
+}
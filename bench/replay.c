@@ -0,0 +1,192 @@
+#define _UTILS_IMPL
+#include <OAuth.h>
+#include <bench.h>
+#include <cache.h>
+#include <spill.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Trace replay comparing the hit ratio of the cache eviction policies against
+// the circular LRU map the cache used to be.
+//
+// usage: replay [trace] [size]
+//   trace  file with one request id per line, '-' or none for the built in
+//          trace: zipf distributed requests over a hot set, interrupted by
+//          scans of one-off endpoints
+//   size   cache size, default runs 512, 2048 and 8192
+//
+// Every lookup that misses inserts the key, like oauth_request does. The
+// spill runs back the cache with a disk tier ten times its size and count a
+// disk hit as a hit, the entry moves back to memory.
+
+#define HOT_KEYS 20000
+#define REQUESTS 500000
+#define SCAN_EVERY 20000
+#define SCAN_LENGTH 4000
+#define ZIPF_S 0.9
+
+map_dec_strkey(response, const char*, response_data)
+map_def_strkey(response, const char*, response_data, cmp_str, murmurhash, {.data = 0})
+
+struct trace {
+    char** keys;
+    uint32_t size;
+    uint32_t cap;
+};
+
+static void trace_add(struct trace* t, char* key) {
+    if (t->size == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 1024;
+        t->keys = realloc(t->keys, t->cap * sizeof(char*));
+    } t->keys[t->size++] = key;
+}
+
+static uint64_t next_rand(uint64_t* x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static void trace_generate(struct trace* t) {
+    double* cdf = malloc(HOT_KEYS * sizeof(double));
+    char** hot = malloc(HOT_KEYS * sizeof(char*));
+    double sum = 0;
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    uint32_t scanned = 0;
+    char buf[128];
+
+    for (uint32_t i = 0; i < HOT_KEYS; i++) {
+        sum += 1.0 / pow(i + 1, ZIPF_S);
+        cdf[i] = sum;
+        hot[i] = str_create_fmt("/GET/https://api.myanimelist.net/v2/anime/%u?fields=id,title", i);
+    }
+
+    for (uint32_t i = 0; i < REQUESTS; i++) {
+        if (i % SCAN_EVERY == SCAN_EVERY - 1) {
+            for (uint32_t j = 0; j < SCAN_LENGTH; j++, scanned++) {
+                snprintf(buf, sizeof(buf), "/GET/https://api.myanimelist.net/v2/anime?q=%u&offset=0", scanned);
+                trace_add(t, strdup(buf));
+            }
+            continue;
+        }
+
+        double r = (double) (next_rand(&seed) >> 11) / (double) (1ull << 53) * sum;
+        uint32_t lo = 0, hi = HOT_KEYS - 1;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if (cdf[mid] < r) lo = mid + 1;
+            else hi = mid;
+        } trace_add(t, strdup(hot[lo]));
+    }
+
+    for (uint32_t i = 0; i < HOT_KEYS; i++)
+        str_destroy(&hot[i]);
+    free(hot);
+    free(cdf);
+}
+
+static bool trace_load(struct trace* t, const char* file) {
+    FILE* fp = fopen(file, "r");
+    char* line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    if (!fp) return false;
+
+    while ((read = getline(&line, &len, fp)) != -1) {
+        if (read && line[read - 1] == '\n') line[--read] = '\0';
+        if (read) trace_add(t, strdup(line));
+    }
+
+    free(line);
+    fclose(fp);
+    return true;
+}
+
+#define SPILL_RATIO 10
+#define SPILL_BODY 512
+
+static char body[SPILL_BODY];
+
+static void replay_evict(void* arg, const char* key, const response_data* value) {
+    spill_put((struct spill*) arg, key, value);
+}
+
+static void replay(struct trace* t, uint32_t size, int policy, bool spill, bool first) {
+    struct cache cache;
+    struct spill disk = {0};
+    struct map_response map;
+    response_data value = {.data = body, .content_type = "application/json", .response_code = 200};
+    response_data found;
+    uint64_t hits = 0, disk_hits = 0;
+    char label[64], extra[128];
+
+    if (policy < 0) {
+        map_init_response(&map, 0, 0);
+        map_set_circular(&map, true);
+        map_set_refresh(&map, true);
+        map_set_max_size(&map, size);
+    } else cache_init(&cache, size, (POLICY) policy);
+
+    // record plus key, about what one spilled entry takes on disk
+    if (spill && spill_open(&disk, "bench_replay.spill", (uint64_t) size * SPILL_RATIO * (SPILL_BODY + 128)))
+        cache_set_evict(&cache, replay_evict, &disk);
+
+    uint64_t start = time_mono_ns();
+    for (uint32_t i = 0; i < t->size; i++) {
+        if (policy < 0) {
+            map_get_response(&map, t->keys[i]);
+            if (map_found(&map)) hits++;
+            else map_put_response(&map, t->keys[i], value);
+        } else if (cache_get(&cache, t->keys[i], &found)) hits++;
+        else if (spill_take(&disk, t->keys[i], &found)) {
+            hits++;
+            disk_hits++;
+            free((char*) found.data);
+            free((char*) found.content_type);
+            cache_put(&cache, t->keys[i], value);
+        } else cache_put(&cache, t->keys[i], value);
+    }
+    uint64_t ns = time_mono_ns() - start;
+
+    snprintf(label, sizeof(label), "%s%s/%u", policy < 0 ? "lru" : POLICY_STRING[policy], spill ? "+spill" : "", size);
+    snprintf(extra, sizeof(extra), "\"hit_ratio\": %.4f, \"disk_hit_ratio\": %.4f",
+             (double) hits / (double) t->size, (double) disk_hits / (double) t->size);
+    bench_report(stdout, first, label, 1, t->size, ns, NULL, (struct bench_allocs) {0}, extra);
+
+    if (policy < 0) map_term_response(&map);
+    else cache_term(&cache);
+    spill_close(&disk);
+}
+
+int main(int argc, char** argv) {
+    static const uint32_t sizes[] = {512, 2048, 8192};
+    struct trace t = {0};
+    uint32_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    if (argc > 1 && strcmp(argv[1], "-")) {
+        if (!trace_load(&t, argv[1]) || t.size == 0) {
+            fprintf(stderr, "usage: %s [trace] [size]\n", argv[0]);
+            return 1;
+        }
+    } else trace_generate(&t);
+    memset(body, 'x', SPILL_BODY - 1);
+
+    printf("{\"benchmark\": \"replay\", \"requests\": %u, \"results\": [", t.size);
+    bool first = true;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (size && i) break;
+        for (int policy = -1; policy < NUM_POLICIES; policy++, first = false)
+            replay(&t, size ? size : sizes[i], policy, false, first);
+        for (int policy = 0; policy < NUM_POLICIES; policy++)
+            replay(&t, size ? size : sizes[i], policy, true, false);
+    }
+    printf("\n]}\n");
+
+    for (uint32_t i = 0; i < t.size; i++)
+        free(t.keys[i]);
+    free(t.keys);
+    return 0;
+}
@@ -0,0 +1,381 @@
+#ifndef _BENCH_SERVER_H
+#define _BENCH_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <utils/atomic.h>
+#include <utils/thread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+typedef SOCKET server_socket;
+#else
+typedef int server_socket;
+#endif
+
+#define SERVER_MAX_ROUTES 64
+#define SERVER_WORKERS 16
+
+/**
+ * Canned response served for every request whose path (query excluded)
+ * matches 'path'. Unknown paths get a 404.
+ */
+struct server_route {
+    const char* path;
+    int status;
+    const char* content_type;
+    const char* body;
+    const char* headers;    // extra "Name: value\r\n" lines, e.g. Retry-After
+    uint32_t latency_ms;    // delay before the status line is sent
+    uint32_t chunk_size;    // stream the body chunked when not zero
+    uint32_t chunk_delay_ms;
+    bool token;             // answer as an OAuth token endpoint
+    uint64_t hits;
+};
+
+struct server {
+    server_socket fd;
+    uint16_t port;
+    uint64_t run;               // atomic, cleared by server_stop()
+    struct server_route routes[SERVER_MAX_ROUTES];
+    uint32_t size;
+    uint64_t requests;
+    uint64_t tokens;
+    struct mutex mtx;
+    struct thread workers[SERVER_WORKERS];
+};
+
+/**
+ * @param s    server
+ * @param port port to listen on 127.0.0.1, zero picks a free one.
+ * @return     'true' once the server accepts connections.
+ */
+bool server_start(struct server* s, uint16_t port);
+
+/**
+ * Stop accepting connections and join all workers.
+ * @param s server
+ */
+void server_stop(struct server* s);
+
+/**
+ * Routes must be added before server_start().
+ * @param s     server
+ * @param route route, copied
+ * @return      'false' if the route table is full.
+ */
+bool server_route(struct server* s, struct server_route route);
+
+/**
+ * Replace the route with the same path, also while the server runs. Requests
+ * already being answered keep the old one, the hits carry over.
+ * @param s     server
+ * @param route route, copied
+ * @return      'false' if there is no route with that path.
+ */
+bool server_update(struct server* s, struct server_route route);
+
+/**
+ * @param s    server
+ * @param path route path
+ * @return     requests served on that path so far.
+ */
+uint64_t server_hits(struct server* s, const char* path);
+
+/**
+ * @param s    server
+ * @param path path, appended to "http://127.0.0.1:<port>"
+ * @return     length prefixed string, free with str_destroy().
+ */
+char* server_url(struct server* s, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(_UTILS_IMPL) || defined(_BENCH_SERVER_IMPL)
+
+#include <utils/str.h>
+#include <utils/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <ws2tcpip.h>
+#define server_close closesocket
+#define SERVER_INVALID INVALID_SOCKET
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#define server_close close
+#define SERVER_INVALID (-1)
+#endif
+
+#define SERVER_MAX_REQUEST 65536
+
+static const char* server_reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 404: return "Not Found";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+// recv() failed only because SO_RCVTIMEO expired
+static bool server_timeout() {
+#if defined(_WIN32) || defined(_WIN64)
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static bool server_send(server_socket fd, const char* data, size_t len) {
+    while (len > 0) {
+        int n = send(fd, data, (int) len, 0);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    } return true;
+}
+
+static struct server_route* server_find(struct server* s, const char* target) {
+    size_t len = strcspn(target, "?#");
+    for (uint32_t i = 0; i < s->size; i++) {
+        if (strlen(s->routes[i].path) == len && !strncmp(s->routes[i].path, target, len))
+            return &s->routes[i];
+    } return NULL;
+}
+
+static bool server_respond(struct server* s, server_socket fd, const char* target, bool keep_alive) {
+    char head[1024];
+    char token[512];
+    struct server_route route = {.status = 404, .content_type = "text/plain", .body = "not found"};
+
+    // copied under the lock, server_update() may replace it meanwhile
+    mutex_lock(&s->mtx);
+    s->requests++;
+    struct server_route* found = server_find(s, target);
+    if (found) {
+        found->hits++;
+        route = *found;
+    }
+    uint64_t token_id = route.token ? ++s->tokens : 0;
+    mutex_unlock(&s->mtx);
+
+    if (route.latency_ms) time_sleep(route.latency_ms);
+
+    const char* body = route.body ? route.body : "";
+    if (route.token) {
+        snprintf(token, sizeof(token),
+                 "{\"token_type\":\"Bearer\",\"access_token\":\"access-%llu\","
+                 "\"refresh_token\":\"refresh-%llu\",\"expires_in\":3600}",
+                 (unsigned long long) token_id, (unsigned long long) token_id);
+        body = token;
+    }
+
+    size_t len = route.status == 304 || route.status == 204 ? 0 : strlen(body);
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nConnection: %s\r\n%s",
+                     route.status, server_reason(route.status),
+                     route.token ? "application/json" : (route.content_type ? route.content_type : "application/json"),
+                     keep_alive ? "keep-alive" : "close", route.headers ? route.headers : "");
+
+    if (!route.chunk_size || len == 0) {
+        n += snprintf(head + n, sizeof(head) - n, "Content-Length: %zu\r\n\r\n", len);
+        return server_send(fd, head, n) && server_send(fd, body, len);
+    }
+
+    n += snprintf(head + n, sizeof(head) - n, "Transfer-Encoding: chunked\r\n\r\n");
+    if (!server_send(fd, head, n)) return false;
+    for (size_t off = 0; off < len; off += route.chunk_size) {
+        size_t size = len - off < route.chunk_size ? len - off : route.chunk_size;
+        n = snprintf(head, sizeof(head), "%zx\r\n", size);
+        if (!server_send(fd, head, n) || !server_send(fd, body + off, size) || !server_send(fd, "\r\n", 2))
+            return false;
+        if (route.chunk_delay_ms) time_sleep(route.chunk_delay_ms);
+    } return server_send(fd, "0\r\n\r\n", 5);
+}
+
+// Serve requests on one connection until the peer closes it, asks to
+// close, or the server stops.
+static void server_serve(struct server* s, server_socket fd) {
+    char* buf = malloc(SERVER_MAX_REQUEST + 1);
+    size_t len = 0;
+    if (buf) buf[0] = '\0';
+
+    while (atomic_get(&s->run) && buf) {
+        char* end = NULL;
+        while (atomic_get(&s->run) && !(end = strstr(buf, "\r\n\r\n"))) {
+            if (len == SERVER_MAX_REQUEST) goto out;
+            int n = recv(fd, buf + len, (int) (SERVER_MAX_REQUEST - len), 0);
+            if (n == 0 || (n < 0 && !server_timeout())) goto out;
+            if (n < 0) continue;
+            len += n;
+            buf[len] = '\0';
+        }
+        if (!end) break;
+
+        char method[16] = {0}, target[2048] = {0};
+        if (sscanf(buf, "%15s %2047s", method, target) != 2) break;
+
+        size_t head_len = end + 4 - buf;
+        size_t body_len = 0;
+        const char* cl = strstr(buf, "Content-Length:");
+        if (!cl) cl = strstr(buf, "content-length:");
+        if (cl && cl < end) body_len = strtoul(cl + 15, NULL, 10);
+        bool keep_alive = !strstr(buf, "Connection: close") && !strstr(buf, "connection: close");
+
+        if (head_len + body_len > SERVER_MAX_REQUEST) break;
+        while (atomic_get(&s->run) && len < head_len + body_len) {
+            int n = recv(fd, buf + len, (int) (SERVER_MAX_REQUEST - len), 0);
+            if (n == 0 || (n < 0 && !server_timeout())) goto out;
+            if (n > 0) len += n;
+        }
+        if (len < head_len + body_len) break;
+
+        if (!server_respond(s, fd, target, keep_alive) || !keep_alive)
+            break;
+
+        len -= head_len + body_len;
+        memmove(buf, buf + head_len + body_len, len);
+        buf[len] = '\0';
+    }
+
+out:
+    free(buf);
+    server_close(fd);
+}
+
+static void* server_worker(void* arg) {
+    struct server* s = (struct server*) arg;
+    while (atomic_get(&s->run)) {
+        server_socket fd = accept(s->fd, NULL, NULL);
+        if (fd == SERVER_INVALID) continue;
+        if (!atomic_get(&s->run)) {
+            server_close(fd);
+            break;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof(one));
+#if defined(_WIN32) || defined(_WIN64)
+        DWORD timeout = 100;
+#else
+        struct timeval timeout = {.tv_sec = 0, .tv_usec = 100000};
+#endif
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*) &timeout, sizeof(timeout));
+        server_serve(s, fd);
+    } return NULL;
+}
+
+bool server_route(struct server* s, struct server_route route) {
+    if (s->size == SERVER_MAX_ROUTES) return false;
+    if (!route.status) route.status = 200;
+    route.hits = 0;
+    s->routes[s->size++] = route;
+    return true;
+}
+
+bool server_update(struct server* s, struct server_route route) {
+    mutex_lock(&s->mtx);
+    struct server_route* old = server_find(s, route.path);
+    if (old) {
+        if (!route.status) route.status = 200;
+        route.hits = old->hits;
+        *old = route;
+    }
+    mutex_unlock(&s->mtx);
+    return old != NULL;
+}
+
+uint64_t server_hits(struct server* s, const char* path) {
+    mutex_lock(&s->mtx);
+    struct server_route* route = server_find(s, path);
+    uint64_t hits = route ? route->hits : 0;
+    mutex_unlock(&s->mtx);
+    return hits;
+}
+
+char* server_url(struct server* s, const char* path) {
+    return str_create_fmt("http://127.0.0.1:%u%s", (unsigned) s->port, path);
+}
+
+bool server_start(struct server* s, uint16_t port) {
+#if defined(_WIN32) || defined(_WIN64)
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+#else
+    // a client hanging up mid response, like a hedge that lost, fails the send
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->fd == SERVER_INVALID) return false;
+    setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, (const char*) &one, sizeof(one));
+
+    if (bind(s->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(s->fd, 128) != 0 ||
+        getsockname(s->fd, (struct sockaddr*) &addr, &addr_len) != 0) {
+        server_close(s->fd);
+        return false;
+    }
+
+    s->port = ntohs(addr.sin_port);
+    s->requests = s->tokens = 0;
+    atomic_set(&s->run, 1);
+    mutex_init(&s->mtx);
+    for (int i = 0; i < SERVER_WORKERS; i++) {
+        thread_init(&s->workers[i]);
+        thread_start(&s->workers[i], server_worker, s);
+    } return true;
+}
+
+void server_stop(struct server* s) {
+    atomic_set(&s->run, 0);
+#if defined(_WIN32) || defined(_WIN64)
+    shutdown(s->fd, SD_BOTH);
+#else
+    shutdown(s->fd, SHUT_RDWR);
+#endif
+    server_close(s->fd);
+    for (int i = 0; i < SERVER_WORKERS; i++)
+        thread_term(&s->workers[i]);
+    mutex_term(&s->mtx);
+#if defined(_WIN32) || defined(_WIN64)
+    WSACleanup();
+#endif
+}
+
+#endif
+#endif
@@ -0,0 +1,299 @@
+#define _UTILS_IMPL
+#include <OAuth.h>
+#include <bench.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Microbenchmarks of the include/utils code on the oauth_request hot path.
+// Every result is reported as ns/op and allocations per op.
+//
+// usage: utils [scale]
+//   scale  multiplies the iteration counts, default 1
+
+map_dec_strkey(request_id, const char*, request_data)
+map_dec_strkey(response, const char*, response_data)
+map_def_strkey(request_id, const char*, request_data, cmp_str, murmurhash, {.id = 0})
+map_def_strkey(response, const char*, response_data, cmp_str, murmurhash, {.data = 0})
+
+char* parse_data(sorted_map* data, const char* data_join);
+
+#define ENDPOINT "https://api.myanimelist.net/v2/anime"
+#define TOKEN_BODY \
+    "{\"token_type\":\"Bearer\",\"expires_in\":2678400,\"access_token\":\"eyJ0eXAiOiJKV1QiLCJhbGciOiJSUzI1NiIs" \
+    "ImpOaSI6ImM3ZGZkOWRiZmNjN2JiYTY0MmQxZmEwNjllNzJkMWQ4NjA0NzA2ODk4M2E4MzVjZWZmMjNjOGQ5M2Y4ZWJlZjM3\"," \
+    "\"refresh_token\":\"def502006deb2f03c54ad461bdcf47e4a6c3317fa1e4eff6981df2e58d42a908833b3c46fed88c700643226\"}"
+#define NODE_BODY \
+    "{\"node\":{\"id\":%d,\"title\":\"Fullmetal Alchemist: Brotherhood\",\"main_picture\":{" \
+    "\"medium\":\"https://cdn.myanimelist.net/images/anime/1223/96541.jpg\"," \
+    "\"large\":\"https://cdn.myanimelist.net/images/anime/1223/96541l.jpg\"},\"mean\":9.1," \
+    "\"genres\":[{\"id\":1,\"name\":\"Action\"},{\"id\":2,\"name\":\"Adventure\"}],\"nsfw\":false}}"
+#define INI_BODY \
+    "[Header]\nContent-Type = application/x-www-form-urlencoded\nX-MAL-CLIENT-ID = ed7f347e239153101c9e6fc6b5bdfece\n\n" \
+    "[Params]\nclient_id = ed7f347e239153101c9e6fc6b5bdfece\nchallenge_method = plain\n" \
+    "token_url = https://myanimelist.net/v1/oauth2/token\nauth_url = https://myanimelist.net/v1/oauth2/authorize\n" \
+    "request_timeout = 250\nsave_on_auth = true\nrefresh_on_auth = false\nrefresh_on_load = false\n" \
+    "cache_file = TEST.cache\ntoken_bearer = Bearer\n\n" \
+    "[Options]\nrequest_cache = true\nrequest_async = false\nrequest_auth = false\n"
+
+static uint64_t scale = 1;
+static uint64_t start;
+static bool first = true;
+static volatile uint64_t sink;
+
+static void bench_begin() {
+    bench_allocs_reset();
+    start = time_mono_ns();
+}
+
+static void bench_end(const char* name, uint64_t ops) {
+    uint64_t ns = time_mono_ns() - start;
+    bench_report(stdout, first, name, 1, ops, ns, NULL, bench_allocs_get(), NULL);
+    first = false;
+}
+
+static char** bench_keys(uint32_t n) {
+    char** keys = malloc(n * sizeof(char*));
+    for (uint32_t i = 0; i < n; i++)
+        keys[i] = str_create_fmt("/GET/" ENDPOINT "/%u?fields=id,title,main_picture,mean&limit=%u", i, i % 100);
+    return keys;
+}
+
+static void bench_free_keys(char** keys, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++)
+        str_destroy(&keys[i]);
+    free(keys);
+}
+
+#define bench_map(name, V, value, field)                                            \
+    static void bench_map_##name(uint32_t size) {                                   \
+        char label[64];                                                             \
+        uint32_t n = size * 4;                                                      \
+        uint64_t ops = 200000 * scale;                                              \
+        char** keys = bench_keys(n);                                                \
+        struct map_##name map;                                                      \
+        V v = value;                                                                \
+                                                                                    \
+        map_init_##name(&map, 0, 0);                                                \
+        map_set_circular(&map, true);                                               \
+        map_set_refresh(&map, true);                                                \
+        map_set_max_size(&map, size);                                               \
+                                                                                    \
+        snprintf(label, sizeof(label), "map_put_" #name "/%u", size);               \
+        bench_begin();                                                              \
+        for (uint64_t i = 0; i < ops; i++)                                          \
+            map_put_##name(&map, keys[i % n], v);                                   \
+        bench_end(label, ops);                                                      \
+                                                                                    \
+        map_clear_##name(&map);                                                     \
+        for (uint32_t i = 0; i < size; i++)                                         \
+            map_put_##name(&map, keys[i], v);                                       \
+                                                                                    \
+        snprintf(label, sizeof(label), "map_get_" #name "/%u", size);               \
+        bench_begin();                                                              \
+        for (uint64_t i = 0; i < ops; i++)                                          \
+            sink += map_get_##name(&map, keys[(i * 7919) % size]).field;            \
+        bench_end(label, ops);                                                      \
+                                                                                    \
+        snprintf(label, sizeof(label), "map_del_" #name "/%u", size);               \
+        uint64_t dels = 0;                                                          \
+        bench_begin();                                                              \
+        while (dels < ops) {                                                        \
+            uint64_t ns = time_mono_ns();                                           \
+            for (uint32_t i = 0; i < size; i++)                                     \
+                map_put_##name(&map, keys[i], v);                                   \
+            start += time_mono_ns() - ns;                                           \
+            for (uint32_t i = 0; i < size; i++)                                     \
+                map_del_##name(&map, keys[i]);                                      \
+            dels += size;                                                           \
+        }                                                                           \
+        bench_end(label, dels);                                                     \
+                                                                                    \
+        map_term_##name(&map);                                                      \
+        bench_free_keys(keys, n);                                                   \
+    }
+
+bench_map(response, response_data, ((response_data) {.data = "{}", .content_type = "application/json", .response_code = 200}), response_code)
+bench_map(request_id, request_data, ((request_data) {.data = "limit=100", .endpoint = ENDPOINT, .id = "id", .method = GET}), method)
+
+static sorted_map* bench_params(uint32_t n, char** keys, char** values) {
+    sorted_map* data = sorted_map_alloc((int (*)(void*, void*)) strcmp);
+    for (uint32_t i = 0; i < n; i++)
+        sorted_map_put(data, keys[i], values[i]);
+    return data;
+}
+
+static void bench_sorted_map(uint32_t n) {
+    char label[64];
+    uint64_t ops = 100000 * scale / n;
+    char** keys = malloc(n * sizeof(char*));
+    char** values = malloc(n * sizeof(char*));
+    for (uint32_t i = 0; i < n; i++) {
+        keys[i] = str_create_fmt("param_%u", (i * 2654435761u) % 1000);
+        values[i] = str_create_fmt("value_%u", i);
+    }
+
+    snprintf(label, sizeof(label), "sorted_map_put_iterate/%u", n);
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        sorted_map* data = bench_params(n, keys, values);
+        char* key; char* value;
+        sorted_map_iterator* it = sorted_map_iterator_alloc(data);
+        while (sorted_map_iterator_has_next(it)) {
+            sorted_map_iterator_next(it, (void**) &key, (void**) &value);
+            sink += key[0];
+        }
+        sorted_map_iterator_free(it);
+        sorted_map_free(data);
+    }
+    bench_end(label, ops);
+
+    snprintf(label, sizeof(label), "parse_data/%u", n);
+    sorted_map* data = bench_params(n, keys, values);
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        char* str = parse_data(data, "&");
+        sink += str[0];
+        str_destroy(&str);
+    }
+    bench_end(label, ops);
+    sorted_map_free(data);
+
+    for (uint32_t i = 0; i < n; i++) {
+        str_destroy(&keys[i]);
+        str_destroy(&values[i]);
+    }
+    free(keys);
+    free(values);
+}
+
+static void bench_json(const char* name, const char* body) {
+    enum { MAX_FIELDS = 4096 };
+    static json_t pool[MAX_FIELDS];
+    size_t len = strlen(body);
+    char* buf = malloc(len + 1);
+    uint64_t ops = 20000000 * scale / (len + 64);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        memcpy(buf, body, len + 1);
+        sink += json_create(buf, pool, MAX_FIELDS) != NULL;
+    }
+    bench_end(name, ops);
+    free(buf);
+}
+
+static void bench_codecs() {
+    uint8_t hash[32];
+    char input[129];
+    uint64_t ops = 200000 * scale;
+    for (int i = 0; i < 128; i++)
+        input[i] = 'a' + i % 26;
+    input[128] = '\0';
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        calc_sha_256(hash, input, 128);
+        sink += hash[0];
+    }
+    bench_end("calc_sha_256/128", ops);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t key[2];
+        calc_murmur_128(key, input, 128);
+        sink += key[0];
+    }
+    bench_end("calc_murmur_128/128", ops);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        char* str = str_encode_base64(input + 64);
+        sink += str[0];
+        str_destroy(&str);
+    }
+    bench_end("str_encode_base64/64", ops);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++) {
+        char* id = NULL;
+        str_append_fmt(&id, "/%s/%s", REQUEST_STRING[GET], ENDPOINT "/5114");
+        str_append_fmt(&id, "?%s", "fields=id,title,main_picture,mean&limit=100");
+        sink += id[0];
+        str_destroy(&id);
+    }
+    bench_end("str_append_fmt/request_id", ops);
+}
+
+static int bench_ini_item(void* arg, int line, const char* section, const char* key, const char* value) {
+    sink += line + key[0];
+    return 0;
+}
+
+static void bench_ini() {
+    const char* file = "bench_utils.ini";
+    uint64_t ops = 20000 * scale;
+    FILE* fp = fopen(file, "w");
+    if (!fp) return;
+    fputs(INI_BODY, fp);
+    fclose(fp);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++)
+        ini_parse_file(NULL, bench_ini_item, file);
+    bench_end("ini_parse_file/config", ops);
+    remove(file);
+}
+
+static void bench_stats() {
+    static char buf[65536];
+    uint64_t ops = 20000 * scale;
+    OAuth* oauth = oauth_create(NULL);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++)
+        sink += oauth_stats_format(oauth, OAUTH_FMT_PROMETHEUS, buf, sizeof(buf));
+    bench_end("oauth_stats_format/prometheus", ops);
+
+    bench_begin();
+    for (uint64_t i = 0; i < ops; i++)
+        sink += oauth_stats_format(oauth, OAUTH_FMT_JSON, buf, sizeof(buf));
+    bench_end("oauth_stats_format/json", ops);
+    oauth_delete(oauth);
+}
+
+int main(int argc, char** argv) {
+    static const uint32_t sizes[] = {64, 1024, 16384};
+    scale = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+    if (scale == 0) {
+        fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"utils\", \"results\": [");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_map_response(sizes[i]);
+        bench_map_request_id(sizes[i]);
+    }
+
+    bench_sorted_map(4);
+    bench_sorted_map(16);
+
+    char* list = str_create("{\"data\":[");
+    for (int i = 0; i < 100; i++) {
+        if (i) str_append(&list, ",");
+        str_append_fmt(&list, NODE_BODY, i);
+    }
+    str_append(&list, "],\"paging\":{\"next\":\"" ENDPOINT "?offset=100&limit=100\"}}");
+    bench_json("json_create/token", TOKEN_BODY);
+    bench_json("json_create/anime_list_100", list);
+    str_destroy(&list);
+
+    bench_codecs();
+    bench_ini();
+    bench_stats();
+
+    printf("\n]}\n");
+    return 0;
+}
@@ -11,13 +11,24 @@
 #include <utils/map.h>
 #include <utils/timer.h>
 #include <utils/path.h>
+#include <utils/atomic.h>
+#include <utils/histogram.h>
+#include <utils/epoch.h>
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 
-#define NUM_PARAMS 21
+#define NUM_PARAMS 35
+#define NUM_OPTIONS 4
+#define NUM_REQUESTS 5
+#define NUM_STATS 19
+#define NUM_STATUS 6
+#define NUM_LATENCIES 3
+#define NUM_PHASES 9
+#define RECORDER_SIZE 256
+#define NUM_POLICIES 2
 
 typedef enum PARAM {
     SAVE_ON_OAUTH,
@@ -40,58 +51,73 @@ typedef enum PARAM {
     CODE_CHALLENGE,
     CODE_VERIFIER,
     REQUEST_QUEUE_SIZE,
-    CACHE_SIZE
+    CACHE_SIZE,
+    REQUEST_DEADLINE,
+    HEDGE_DELAY,
+    BREAKER_THRESHOLD,
+    BREAKER_FAILURE_RATE,
+    BREAKER_COOLDOWN,
+    CACHE_POLICY,
+    CACHE_MAX_BYTES,
+    CACHE_MAX_ENTRY_BYTES,
+    SPILL_FILE,
+    SPILL_MAX_BYTES,
+    JOURNAL_RATIO,
+    PERSIST_INTERVAL,
+    CACHE_LAZY_LOAD,
+    CACHE_LOAD_THREADS
 } PARAM;
 
-static const char* PARAM_STRING[] = {
-    "save_on_auth",
-    "save_on_close",
-    "refresh_on_auth",
-    "refresh_on_load",
-    "request_on_load",
-    "client_id",
-    "client_secret",
-    "challenge_method",
-    "redirect_uri",
-    "token_url",
-    "auth_url", 
-    "config_file",
-    "cache_file",
-    "request_timeout",
-    "access_token",
-    "token_bearer",
-    "refresh_token",
-    "code_challenge",
-    "code_verifier",
-    "request_queue_size",
-    "cache_size"
-};
+extern const char* PARAM_STRING[];
 
 // THE OPTIONS MAY BE CHANGED TEMPORARILY FOR A REQUEST
 typedef enum OPTION {
     REQUEST_CACHE = 1, 
     REQUEST_ASYNC = 2,
-    REQUEST_AUTH = 4
+    REQUEST_AUTH = 4,
+    REQUEST_HEDGE = 8
 } OPTION;
 
-static const char* OPTION_STRING[] = {
-    "request_cache",
-    "request_async",
-    "request_auth"
-};
+extern const char* OPTION_STRING[];
+
+// CACHE EVICTION, CLOCK IS THE DEFAULT
+typedef enum POLICY {
+    POLICY_CLOCK,
+    POLICY_TINYLFU
+} POLICY;
+
+extern const char* POLICY_STRING[];
 
 typedef enum REQUEST {
     POST, PUT, GET, PATCH, DEL
 } REQUEST;
 
-static const char *REQUEST_STRING[] = {
-    "POST", "PUT", "GET", "PATCH", "DELETE"
-};
+extern const char* REQUEST_STRING[];
+
+// WHERE THE TIME OF A REQUEST WENT, IN MICROSECONDS. THE FIRST SIX COME FROM
+// CURL AND ARE ZERO WHEN THE REQUEST NEVER WENT UPSTREAM
+typedef enum PHASE {
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_TTFB,
+    PHASE_TRANSFER,
+    PHASE_UPSTREAM,
+    PHASE_QUEUE_WAIT,
+    PHASE_CACHE_LOOKUP,
+    PHASE_PARSE
+} PHASE;
+
+extern const char* PHASE_STRING[];
 
 typedef struct response_data {
     const char* data;
     const char* content_type;
     long response_code;
+    uint64_t time;
+    uint64_t timing[NUM_PHASES];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
 } response_data;
 
 typedef struct request_data {
@@ -100,8 +126,126 @@ typedef struct request_data {
     REQUEST method;
     const char* endpoint;
     const char* id;
+    uint64_t enqueued;
+    uint64_t deadline;
 } request_data;
 
+typedef enum BREAKER {
+    BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN
+} BREAKER;
+
+extern const char* BREAKER_STRING[];
+
+typedef struct breaker_data {
+    BREAKER state;
+    uint32_t consecutive_failures;
+    uint32_t window_requests;
+    uint32_t window_failures;
+    uint64_t opened;
+    bool probing;
+} breaker_data;
+
+typedef enum STAT {
+    CACHE_HITS,
+    CACHE_MISSES,
+    CACHE_STALE_HITS,
+    CACHE_EVICTIONS,
+    QUEUE_DROPS,
+    QUEUE_SKIPPED,
+    QUEUE_REFRESHES,
+    TOKEN_REFRESHES,
+    TOKEN_REFRESH_FAILURES,
+    HEDGES_SENT,
+    HEDGES_WON,
+    BREAKER_REJECTS,
+    BYTES_IN,
+    BYTES_OUT,
+    CACHE_OVERSIZED,
+    SPILL_HITS,
+    SPILL_WRITES,
+    CACHE_FAULTS,
+    CACHE_INVALIDATIONS
+} STAT;
+
+extern const char* STAT_STRING[];
+
+// STATUS_ERROR COUNTS TRANSFERS THAT GOT NO RESPONSE AT ALL
+typedef enum STATUS {
+    STATUS_ERROR, STATUS_1XX, STATUS_2XX, STATUS_3XX, STATUS_4XX, STATUS_5XX
+} STATUS;
+
+extern const char* STATUS_STRING[];
+
+// LATENCIES ARE RECORDED IN MICROSECONDS
+typedef enum LATENCY {
+    LATENCY_SYNC, LATENCY_ASYNC, LATENCY_QUEUE
+} LATENCY;
+
+extern const char* LATENCY_STRING[];
+
+typedef struct oauth_stats {
+    uint64_t counters[NUM_STATS];
+    uint64_t requests[NUM_REQUESTS][NUM_STATUS];
+    uint64_t queue_depth;
+    uint64_t cache_entries;
+    uint64_t cache_bytes;        // key, body, content type and bookkeeping
+    uint64_t cache_saved_bytes;  // bodies and content types shared instead of stored again
+    uint64_t spill_bytes;        // live records of the disk tier
+    uint64_t cache_load_us;      // last oauth_load_cache
+    struct histogram latency[NUM_LATENCIES];
+    struct histogram phases[NUM_PHASES];
+} oauth_stats;
+
+// HOW THE CACHE TOOK PART IN A REQUEST. REFRESH MARKS THE WORKER'S OWN REQUESTS
+typedef enum OUTCOME {
+    OUTCOME_BYPASS, OUTCOME_HIT, OUTCOME_MISS, OUTCOME_STALE, OUTCOME_REJECTED, OUTCOME_REFRESH
+} OUTCOME;
+
+extern const char* OUTCOME_STRING[];
+
+// ONE FLIGHT RECORDER ENTRY, TIMES IN MICROSECONDS. THE LAYOUT IS ALSO THE
+// RECORD FORMAT OF oauth_recorder_dump FILES
+typedef struct record_data {
+    uint64_t seq;
+    uint64_t time;
+    uint32_t endpoint;
+    uint16_t status;
+    uint8_t method;
+    uint8_t outcome;
+    uint32_t latency;
+    uint32_t timing[NUM_PHASES];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} record_data;
+
+typedef enum STAGE {
+    STAGE_BUILD,
+    STAGE_CACHE_LOOKUP,
+    STAGE_ENQUEUE,
+    STAGE_TRANSFER,
+    STAGE_PARSE,
+    STAGE_CACHE_INSERT,
+    STAGE_PERSIST
+} STAGE;
+
+extern const char* STAGE_STRING[];
+
+// TRACING HOOKS, EVERY ONE MAY BE NULL. request_begin RETURNS THE CONTEXT
+// HANDED TO THE STAGE HOOKS AND request_end OF THAT REQUEST (OR OF THE WORKER'S
+// REFRESH). TOKEN PARSING AND PERSISTENCE RUN OUTSIDE A REQUEST AND GET A NULL
+// CONTEXT. BUILDING WITH -DOAUTH_NO_TRACE REMOVES THE HOOK CALLS ENTIRELY
+typedef struct trace_hooks {
+    void* (*request_begin)(void* arg, REQUEST method, const char* endpoint);
+    void (*request_end)(void* arg, void* ctx, const response_data* response);
+    void (*stage_begin)(void* arg, void* ctx, STAGE stage);
+    void (*stage_end)(void* arg, void* ctx, STAGE stage);
+    void* arg;
+} trace_hooks;
+
+typedef enum FORMAT {
+    OAUTH_FMT_PROMETHEUS, OAUTH_FMT_JSON
+} FORMAT;
+
 typedef struct OAuth OAuth;
 
 OAuth* oauth_create(const char* config_file);
@@ -115,11 +259,29 @@ bool oauth_stop_refresh(OAuth* oauth);
 
 void oauth_append_header(OAuth* oauth, const char* key, const char* value);
 void oauth_append_data(OAuth* oauth, const char* key, const char* value);
+void oauth_append_tag(OAuth* oauth, const char* tag);
+// A SUCCESSFUL WRITE TO A PATH MATCHING 'pattern' DROPS THE CACHED READS UNDER
+// 'targets', SPACE SEPARATED PATHS ON THE SAME HOST. '*' MATCHES ONE SEGMENT
+void oauth_add_invalidation(OAuth* oauth, const char* pattern, const char* targets);
 void oauth_set_param(OAuth* oauth, PARAM param, char* value);
 bool oauth_set_options(OAuth* oauth, uint8_t options);
+void oauth_set_trace(OAuth* oauth, const trace_hooks* hooks);
+void oauth_set_deadline(OAuth* oauth, uint64_t ms);
 
 void oauth_start_request_thread(OAuth* oauth);
 void oauth_stop_request_thread(OAuth* oauth);
+uint64_t oauth_queue_skipped(OAuth* oauth);
+void oauth_hedge_stats(OAuth* oauth, uint64_t* sent, uint64_t* won);
+breaker_data oauth_breaker(OAuth* oauth, const char* host);
+void oauth_get_stats(OAuth* oauth, oauth_stats* stats);
+size_t oauth_stats_format(OAuth* oauth, FORMAT format, char* buf, size_t size);
+size_t oauth_recorder_snapshot(OAuth* oauth, record_data* records, size_t max);
+bool oauth_recorder_dump(OAuth* oauth, const char* file);
+bool oauth_recorder_on_signal(OAuth* oauth, int signum, const char* file);
+// A PREFIX MATCHES WHOLE PATH SEGMENTS, ONE ENDING IN '/' EVERYTHING BELOW IT
+uint32_t oauth_cache_invalidate_prefix(OAuth* oauth, const char* prefix);
+uint32_t oauth_cache_invalidate_tag(OAuth* oauth, const char* tag);
+// THE DATA AND CONTENT TYPE OF THE RESPONSE ARE ALWAYS OWNED BY THE CALLER, WHO FREES THEM
 response_data oauth_request(OAuth* oauth, REQUEST method, const char* endpoint);
 
 bool oauth_load(OAuth* oauth);
@@ -0,0 +1,70 @@
+#ifndef _UTILS_ATOMIC_H
+#define _UTILS_ATOMIC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Lock free operations on 64 bit integers (and pointers on GCC/Clang).
+ *
+ * atomic_add() is relaxed and meant for counters, atomic_get() has acquire,
+ * atomic_set() release and atomic_cas() sequentially consistent semantics.
+ */
+
+#if defined(_MSC_VER)
+
+#include <windows.h>
+
+#define THREAD_LOCAL __declspec(thread)
+
+#define atomic_add(p, v) InterlockedExchangeAdd64((LONG64 volatile *) (p), (LONG64) (v))
+#define atomic_get(p) InterlockedCompareExchange64((LONG64 volatile *) (p), 0, 0)
+#define atomic_set(p, v) InterlockedExchange64((LONG64 volatile *) (p), (LONG64) (v))
+#define atomic_xchg(p, v) InterlockedExchange64((LONG64 volatile *) (p), (LONG64) (v))
+#define atomic_cas(p, e, d)                                                    \
+	(InterlockedCompareExchange64((LONG64 volatile *) (p), (LONG64) (d),    \
+				      (LONG64) (e)) == (LONG64) (e))
+#define atomic_fence() MemoryBarrier()
+
+#else
+
+#define THREAD_LOCAL __thread
+
+#define atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_get(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_set(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_cas(p, e, d)                                                    \
+	__extension__({                                                        \
+		__typeof__(*(p)) _e = (e);                                     \
+		__atomic_compare_exchange_n((p), &_e, (d), false,              \
+					    __ATOMIC_SEQ_CST,                  \
+					    __ATOMIC_SEQ_CST);                 \
+	})
+#define atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#endif
+
+/**
+ * Raise '*p' to 'v' if it is smaller.
+ *
+ * @param p pointer to a 64 bit value
+ * @param v candidate maximum
+ */
+static inline void atomic_max(uint64_t *p, uint64_t v)
+{
+	uint64_t cur = (uint64_t) atomic_get(p);
+	while (cur < v && !atomic_cas(p, cur, v)) {
+		cur = (uint64_t) atomic_get(p);
+	}
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef _UTILS_EPOCH_H
+#define _UTILS_EPOCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Process wide epoch based reclamation.
+ *
+ * Readers wrap every access to shared nodes in epoch_enter()/epoch_exit(),
+ * which only write to a slot private to the calling thread. Writers unlink a
+ * node, tag it with epoch_now() and free it once epoch_safe(tag) returns
+ * true, by then every reader that could have seen the node has left.
+ *
+ * Each thread claims one of EPOCH_THREADS slots on its first epoch_enter()
+ * and gives it back when it exits. When none is left epoch_enter() returns
+ * false and the caller has to fall back to locking, until another thread
+ * exits and the next epoch_enter() gets to try again.
+ */
+#define EPOCH_THREADS 256
+
+/**
+ * Start a read side critical section, may be nested.
+ *
+ * @return 'false' if the thread has no slot, nothing was entered then.
+ */
+bool epoch_enter();
+
+/**
+ * End the critical section opened by the matching epoch_enter().
+ */
+void epoch_exit();
+
+/**
+ * @return tag for a node unlinked now
+ */
+uint64_t epoch_now();
+
+/**
+ * Try to advance the global epoch, never blocks.
+ *
+ * @param tag epoch_now() at the time the node was unlinked
+ * @return    'true' if no reader can still reference the node.
+ */
+bool epoch_safe(uint64_t tag);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(_UTILS_IMPL) || defined(_UTILS_EPOCH_IMPL)
+
+#include "atomic.h"
+
+struct epoch_slot {
+	uint64_t epoch; // zero while the owner is outside a critical section
+	uint64_t owned;
+	char pad[48];
+};
+
+static struct epoch_slot epoch_slots[EPOCH_THREADS];
+static uint64_t epoch_global = 1;
+static uint64_t epoch_freed; // bumped for every slot given back
+static THREAD_LOCAL int32_t epoch_index; // slot + 1, -1 if none was free
+static THREAD_LOCAL uint32_t epoch_depth;
+static THREAD_LOCAL uint64_t epoch_missed; // epoch_freed when no slot was left
+
+// Runs in the exiting thread, whose slot is free for the next one then
+static void epoch_release(void *arg)
+{
+	struct epoch_slot *slot = &epoch_slots[(intptr_t) arg - 1];
+
+	epoch_index = 0;
+	epoch_depth = 0;
+	atomic_set(&slot->epoch, 0);
+	atomic_set(&slot->owned, 0);
+	atomic_add(&epoch_freed, 1);
+}
+
+#if defined(_MSC_VER)
+
+static DWORD epoch_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE epoch_once = INIT_ONCE_STATIC_INIT;
+
+static void WINAPI epoch_release_fls(void *arg)
+{
+	if (arg) {
+		epoch_release(arg);
+	}
+}
+
+static BOOL CALLBACK epoch_key_init(PINIT_ONCE once, void *arg, void **ctx)
+{
+	epoch_key = FlsAlloc(epoch_release_fls);
+	return TRUE;
+}
+
+static void epoch_own(int32_t index)
+{
+	InitOnceExecuteOnce(&epoch_once, epoch_key_init, NULL, NULL);
+	if (epoch_key != FLS_OUT_OF_INDEXES) {
+		FlsSetValue(epoch_key, (void *) (intptr_t) index);
+	}
+}
+
+#else
+
+#include <pthread.h>
+
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+static void epoch_key_init()
+{
+	pthread_key_create(&epoch_key, epoch_release);
+}
+
+static void epoch_own(int32_t index)
+{
+	pthread_once(&epoch_once, epoch_key_init);
+	pthread_setspecific(epoch_key, (void *) (intptr_t) index);
+}
+
+#endif
+
+static struct epoch_slot *epoch_slot_get()
+{
+	// a slotless thread only scans again once some slot was given back
+	if (epoch_index == 0 ||
+	    (epoch_index < 0 && (uint64_t) atomic_get(&epoch_freed) != epoch_missed)) {
+		epoch_missed = (uint64_t) atomic_get(&epoch_freed);
+		epoch_index = -1;
+		for (int32_t i = 0; i < EPOCH_THREADS; i++) {
+			if (!atomic_get(&epoch_slots[i].owned) &&
+			    atomic_cas(&epoch_slots[i].owned, 0, 1)) {
+				epoch_index = i + 1;
+				epoch_own(epoch_index);
+				break;
+			}
+		}
+	}
+
+	return epoch_index > 0 ? &epoch_slots[epoch_index - 1] : NULL;
+}
+
+bool epoch_enter()
+{
+	struct epoch_slot *slot = epoch_slot_get();
+	uint64_t e, cur;
+
+	if (!slot) {
+		return false;
+	}
+
+	if (epoch_depth++ == 0) {
+		// announce, then make sure the epoch did not move meanwhile
+		e = (uint64_t) atomic_get(&epoch_global);
+		while (true) {
+			atomic_set(&slot->epoch, e);
+			atomic_fence();
+			cur = (uint64_t) atomic_get(&epoch_global);
+			if (cur == e) {
+				break;
+			}
+			e = cur;
+		}
+	}
+
+	return true;
+}
+
+void epoch_exit()
+{
+	if (--epoch_depth == 0) {
+		atomic_set(&epoch_slots[epoch_index - 1].epoch, 0);
+	}
+}
+
+uint64_t epoch_now()
+{
+	return (uint64_t) atomic_get(&epoch_global);
+}
+
+bool epoch_safe(uint64_t tag)
+{
+	uint64_t e = (uint64_t) atomic_get(&epoch_global);
+
+	if (e >= tag + 2) {
+		return true;
+	}
+
+	atomic_fence();
+	for (int32_t i = 0; i < EPOCH_THREADS; i++) {
+		uint64_t v = (uint64_t) atomic_get(&epoch_slots[i].epoch);
+		if (v != 0 && v != e) {
+			return false;
+		}
+	}
+
+	atomic_cas(&epoch_global, e, e + 1);
+	return (uint64_t) atomic_get(&epoch_global) >= tag + 2;
+}
+
+#endif
+#endif
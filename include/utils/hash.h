@@ -105,6 +105,26 @@ uint32_t hash_64(uint64_t a);
 
 uint32_t murmurhash(const char *key);
 
+/*
+ * @brief Streaming state of MurmurHash3 x64_128, hashing the input in pieces gives the same value as hashing it
+ * at once, without copying it anywhere.
+ */
+struct Murmur_128 {
+	uint64_t h1;
+	uint64_t h2;
+	uint8_t tail[16];
+	size_t tail_len;
+	size_t total_len;
+};
+
+void murmur_128_init(struct Murmur_128 *murmur, uint64_t seed);
+
+void murmur_128_write(struct Murmur_128 *murmur, const void *data, size_t len);
+
+void murmur_128_close(struct Murmur_128 *murmur, uint64_t hash[2]);
+
+void calc_murmur_128(uint64_t hash[2], const void *input, size_t len);
+
 bool cmp_int(uint64_t old, uint64_t key);
 
 bool cmp_str(const char* old, const char *key);
@@ -115,6 +135,9 @@ bool cmp_str(const char* old, const char *key);
 
 #if defined(_UTILS_IMPL) || defined(_UTILS_HASH_IMPL)
 
+#include <stdio.h>
+#include <string.h>
+
 uint32_t hash_32(uint32_t a)
 {
 	return a;
@@ -173,6 +196,110 @@ uint32_t murmurhash(const char *key)
 	return (uint32_t) h;
 }
 
+#define MURMUR_128_C1 UINT64_C(0x87c37b91114253d5)
+#define MURMUR_128_C2 UINT64_C(0x4cf5ad432745937f)
+
+static inline uint64_t murmur_rotl(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64u - r));
+}
+
+static inline uint64_t murmur_fmix(uint64_t k)
+{
+	k ^= k >> 33u;
+	k *= UINT64_C(0xff51afd7ed558ccd);
+	k ^= k >> 33u;
+	k *= UINT64_C(0xc4ceb9fe1a85ec53);
+	k ^= k >> 33u;
+	return k;
+}
+
+static inline uint64_t murmur_load(const uint8_t *p, size_t len)
+{
+	uint64_t k = 0;
+	for (size_t i = 0; i < len; i++)
+		k |= (uint64_t) p[i] << (8u * i);
+	return k;
+}
+
+static inline void murmur_block(struct Murmur_128 *murmur, const uint8_t *p)
+{
+	uint64_t k1, k2;
+	memcpy(&k1, p, sizeof(k1));
+	memcpy(&k2, p + 8, sizeof(k2));
+
+	k1 *= MURMUR_128_C1; k1 = murmur_rotl(k1, 31); k1 *= MURMUR_128_C2; murmur->h1 ^= k1;
+	murmur->h1 = murmur_rotl(murmur->h1, 27); murmur->h1 += murmur->h2; murmur->h1 = murmur->h1 * 5 + 0x52dce729;
+
+	k2 *= MURMUR_128_C2; k2 = murmur_rotl(k2, 33); k2 *= MURMUR_128_C1; murmur->h2 ^= k2;
+	murmur->h2 = murmur_rotl(murmur->h2, 31); murmur->h2 += murmur->h1; murmur->h2 = murmur->h2 * 5 + 0x38495ab5;
+}
+
+void murmur_128_init(struct Murmur_128 *murmur, uint64_t seed)
+{
+	murmur->h1 = murmur->h2 = seed;
+	murmur->tail_len = murmur->total_len = 0;
+}
+
+void murmur_128_write(struct Murmur_128 *murmur, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	murmur->total_len += len;
+
+	if (murmur->tail_len) {
+		size_t n = 16 - murmur->tail_len < len ? 16 - murmur->tail_len : len;
+		memcpy(murmur->tail + murmur->tail_len, p, n);
+		murmur->tail_len += n;
+		p += n;
+		len -= n;
+		if (murmur->tail_len < 16)
+			return;
+		murmur_block(murmur, murmur->tail);
+		murmur->tail_len = 0;
+	}
+
+	for (; len >= 16; p += 16, len -= 16)
+		murmur_block(murmur, p);
+
+	memcpy(murmur->tail, p, len);
+	murmur->tail_len = len;
+}
+
+void murmur_128_close(struct Murmur_128 *murmur, uint64_t hash[2])
+{
+	uint64_t h1 = murmur->h1, h2 = murmur->h2;
+	size_t rest = murmur->tail_len;
+
+	if (rest > 8) {
+		uint64_t k2 = murmur_load(murmur->tail + 8, rest - 8);
+		k2 *= MURMUR_128_C2; k2 = murmur_rotl(k2, 33); k2 *= MURMUR_128_C1; h2 ^= k2;
+	}
+	if (rest) {
+		uint64_t k1 = murmur_load(murmur->tail, rest > 8 ? 8 : rest);
+		k1 *= MURMUR_128_C1; k1 = murmur_rotl(k1, 31); k1 *= MURMUR_128_C2; h1 ^= k1;
+	}
+
+	h1 ^= (uint64_t) murmur->total_len;
+	h2 ^= (uint64_t) murmur->total_len;
+	h1 += h2;
+	h2 += h1;
+	h1 = murmur_fmix(h1);
+	h2 = murmur_fmix(h2);
+	h1 += h2;
+	h2 += h1;
+
+	hash[0] = h1;
+	hash[1] = h2;
+}
+
+void calc_murmur_128(uint64_t hash[2], const void *input, size_t len)
+{
+	struct Murmur_128 murmur;
+	murmur_128_init(&murmur, 0);
+	murmur_128_write(&murmur, input, len);
+	murmur_128_close(&murmur, hash);
+}
+
 bool cmp_int(uint64_t old, uint64_t key)
 {
 	return (old == key);
@@ -0,0 +1,168 @@
+#ifndef _UTILS_HISTOGRAM_H
+#define _UTILS_HISTOGRAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * Log-linear (HDR style) histogram. Every power of two range is split into
+ * 2^HISTOGRAM_SUB_BITS linear buckets, so a recorded value is off by at most
+ * 1/2^HISTOGRAM_SUB_BITS (12.5%). Values at or above 2^HISTOGRAM_MAX_BITS
+ * land in the last bucket.
+ *
+ * Recording is lock free, histograms written by different threads can be
+ * merged when read.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 32
+#define HISTOGRAM_SUB (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_SUB + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @param v value
+ * @return  bucket index of 'v'
+ */
+uint32_t histogram_bucket(uint64_t v);
+
+/**
+ * @param bucket bucket index
+ * @return       largest value that falls in 'bucket'
+ */
+uint64_t histogram_upper(uint32_t bucket);
+
+/**
+ * Thread safe, lock free.
+ *
+ * @param h histogram
+ * @param v value to record
+ */
+void histogram_record(struct histogram *h, uint64_t v);
+
+/**
+ * Add every sample of 'src' to 'dst'. 'dst' must not be written concurrently.
+ *
+ * @param dst destination
+ * @param src source, may be written concurrently
+ */
+void histogram_merge(struct histogram *dst, struct histogram *src);
+
+/**
+ * @param h histogram
+ * @param p percentile in [0, 100]
+ * @return  upper bound of the bucket holding the p'th percentile, zero if
+ *          the histogram is empty.
+ */
+uint64_t histogram_percentile(struct histogram *h, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(_UTILS_IMPL) || defined(_UTILS_HISTOGRAM_IMPL)
+
+#include "atomic.h"
+
+static uint32_t histogram_msb(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return 63 - __builtin_clzll(v);
+#else
+	uint32_t msb = 0;
+	while (v >>= 1) {
+		msb++;
+	}
+	return msb;
+#endif
+}
+
+uint32_t histogram_bucket(uint64_t v)
+{
+	uint32_t msb, shift;
+
+	if (v < HISTOGRAM_SUB) {
+		return (uint32_t) v;
+	}
+
+	msb = histogram_msb(v);
+	if (msb >= HISTOGRAM_MAX_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	shift = msb - HISTOGRAM_SUB_BITS;
+	return HISTOGRAM_SUB + shift * HISTOGRAM_SUB +
+	       (uint32_t) ((v >> shift) & (HISTOGRAM_SUB - 1));
+}
+
+uint64_t histogram_upper(uint32_t bucket)
+{
+	uint32_t shift, sub;
+
+	if (bucket < HISTOGRAM_SUB) {
+		return bucket;
+	}
+
+	shift = (bucket - HISTOGRAM_SUB) / HISTOGRAM_SUB;
+	sub = (bucket - HISTOGRAM_SUB) % HISTOGRAM_SUB;
+	return (((uint64_t) (HISTOGRAM_SUB + sub + 1)) << shift) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t v)
+{
+	atomic_add(&h->buckets[histogram_bucket(v)], 1);
+	atomic_add(&h->count, 1);
+	atomic_add(&h->sum, v);
+	atomic_max(&h->max, v);
+}
+
+void histogram_merge(struct histogram *dst, struct histogram *src)
+{
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->buckets[i] += (uint64_t) atomic_get(&src->buckets[i]);
+	}
+
+	dst->count += (uint64_t) atomic_get(&src->count);
+	dst->sum += (uint64_t) atomic_get(&src->sum);
+	if ((uint64_t) atomic_get(&src->max) > dst->max) {
+		dst->max = (uint64_t) atomic_get(&src->max);
+	}
+}
+
+uint64_t histogram_percentile(struct histogram *h, double p)
+{
+	uint64_t total = 0, seen = 0, rank;
+
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		total += h->buckets[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t) (p / 100.0 * (double) total + 0.5);
+	rank = rank == 0 ? 1 : (rank > total ? total : rank);
+
+	for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			uint64_t upper = histogram_upper(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+#endif
+#endif
@@ -14,15 +14,19 @@ typedef struct ini_entry {
 	const char* value;
 } ini_entry;
 
+// Every parameter fits in one section
+#define INI_MAX_ENTRIES 64
+#define INI_MAX_SECTIONS 32
+
 typedef struct ini_section {
 	const char* name;
-	ini_entry entries[32];
+	ini_entry entries[INI_MAX_ENTRIES];
 	uint32_t size;
 } ini_section;
 
 typedef struct ini {
 	const char* filename;
-	ini_section sections[32];
+	ini_section sections[INI_MAX_SECTIONS];
 	uint32_t size;
 } ini;
 
@@ -74,9 +78,15 @@ bool ini_close(ini* arg);
 
 #include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #pragma warning(disable : 4996)
+#include <io.h>
+#define ini_fsync(fp) _commit(_fileno(fp))
+#else
+#include <unistd.h>
+#define ini_fsync(fp) fsync(fileno(fp))
 #endif
 
 static int ini_default_fn(ini *arg, int line, const char *section, const char *key, const char *value) {
@@ -86,14 +96,14 @@ static int ini_default_fn(ini *arg, int line, const char *section, const char *k
 		!section[0] || 
 		strcmp(arg->sections[arg->size - 1].name, section)
 	) {
-		if (arg->size == 32) return 1;
+		if (arg->size == INI_MAX_SECTIONS) return 1;
 		index = arg->size++;
 		arg->sections[index].name = strdup(section);
 		arg->sections[index].size = 0;
 	} else index = arg->size - 1;
 
 	ini_section* ini_sec = &arg->sections[index];
-	if (ini_sec->size == 32) return 1;
+	if (ini_sec->size == INI_MAX_ENTRIES) return 1;
 	index = ini_sec->size++;
 	ini_sec->entries[index].key = strdup(key);
 	ini_sec->entries[index].value = strdup(value);
@@ -114,8 +124,15 @@ bool ini_close(ini* arg) {
 		return NULL;
 	}
 
-    FILE *fp = fopen(arg->filename, "w");
-    if (fp == NULL) return NULL;
+	// written next to the file and renamed over it, a reader never sees
+	// half of it
+	char *tmp = malloc(strlen(arg->filename) + 5);
+	sprintf(tmp, "%s.tmp", arg->filename);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+		free(tmp);
+		return NULL;
+	}
 
 	ini_section* sec;
     for (uint32_t i = 0; i < arg->size; i++) {
@@ -126,9 +143,16 @@ bool ini_close(ini* arg) {
 		}
 	}
         
-    // close the file
-    fclose(fp);
-    return 1;
+    // flushed to disk before the rename so a crash can't leave it empty
+	bool ok = !fflush(fp) && !ini_fsync(fp);
+	ok = !fclose(fp) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+	if (ok) remove(arg->filename);
+#endif
+	ok = ok && !rename(tmp, arg->filename);
+	if (!ok) remove(tmp);
+	free(tmp);
+    return ok;
 }
 
 bool ini_save(ini* arg, const char* section, const char* key, const char* value) {
@@ -148,11 +172,12 @@ bool ini_save(ini* arg, const char* section, const char* key, const char* value)
 		}
 	}
 
-	if (i == 32) return 0;
+	if (i == INI_MAX_SECTIONS) return 0;
 
 	// If not found then add the section and return
 	ini_section* sec = &arg->sections[i];
 	if (!found) {
+		arg->size++;
 		sec->name = strdup(section);
 		sec->size = 1;
 		sec->entries[0].key = strdup(key);
@@ -169,11 +194,12 @@ bool ini_save(ini* arg, const char* section, const char* key, const char* value)
 		}
 	}
 
-	if (i == 32) return 0;
+	if (i == INI_MAX_ENTRIES) return 0;
 
 	// If not found create entry, else update it
 	ini_entry* ent = &sec->entries[i];
 	if (!found) {
+		sec->size++;
 		ent->key = strdup(key);
 		ent->value = strdup(value);
 		return 1;
@@ -138,6 +138,17 @@ extern "C"
 	/** NOLINTNEXTLINE */                                                \
 	V map_del_##name(struct map_##name *map, K key);                     \
                                                                          \
+	/**                                                                  \
+	 * Get element without refreshing its position in the list           \
+	 *                                                                   \
+	 * @param map map                                                    \
+	 * @param K key                                                      \
+	 * @return current value if exists.                                  \
+	 *         call map_found() to see if the returned value is valid.   \
+	 */                                                                  \
+	/** NOLINTNEXTLINE */                                                \
+	V map_peek_##name(struct map_##name *map, K key);                    \
+                                                                         \
 	void map_refresh_or_add_##name(struct map_##name *map, bool refresh, struct map_link_##name *link);
 
 /**
@@ -155,13 +166,14 @@ extern "C"
 #define map_oom(map) ((map)->oom)
 
 #define map_set_max_size(map, v)										\
+	do {																\
+		if ((v) <= 0 || (v) > MAP_MAX * (map)->load_fac / 100)			\
+		{																\
+			(map)->max_size = 0;										\
+		}																\
 																		\
-	if ((v) <= 0 || (v) > MAP_MAX * (map)->load_fac / 100)				\
-	{																	\
-		(map)->max_size = 0;											\
-	}																	\
-																		\
-	(map)->max_size = (v)
+		(map)->max_size = (v);											\
+	} while (0)
 
 #define map_set_refresh(map, v) ((map)->refresh = (v))
 #define map_set_circular(map, v) ((map)->circular = (v))
@@ -299,6 +311,7 @@ map_dec_strkey(s64, const char *, uint64_t)
 																\
 	void map_refresh_or_add_##name(struct map_##name *m, bool refresh, struct map_link_##name *link) {												\
 		if (!refresh) {													\
+			link->next = 0; /* a reused slot keeps its old link */		\
 			if (!m->head) {												\
 				m->head = m->tail = link;								\
 				link->prev = 0;											\
@@ -317,8 +330,8 @@ map_dec_strkey(s64, const char *, uint64_t)
 			link->prev = m->tail;										\
 			m->tail->next = link;										\
 			m->tail = link;												\
+			link->next = 0;												\
 		}																		\
-		link->next = 0;											\
 	}																			\
 																				\
 	static void map_alloc_##name(uint32_t *cap, uint32_t factor, struct map_item_##name** t, struct map_link_##name **p)							\
@@ -349,8 +362,8 @@ map_dec_strkey(s64, const char *, uint64_t)
 	bool map_init_##name(struct map_##name *m, uint32_t cap,         \
 				uint32_t load_fac)                             \
 	{                                                                      \
-		void *t;                                                       \
-		void *p;                                                       \
+		struct map_item_##name *t;                                     \
+		struct map_link_##name *p;                                     \
 		uint32_t f = (load_fac == 0) ? 75 : load_fac;                  \
                                                                                \
 		if (f > 95 || f < 25) {                                        \
@@ -434,7 +447,7 @@ map_dec_strkey(s64, const char *, uint64_t)
 		for (uint32_t i = 0; i < m->cap; i++) {                        \
 			if (m->mem[i].key != 0) {                              				\
 				pos = map_hashof_##name(&m->mem[i]) & mod;  					\
-				if (i == idx) *idx = pos;										\
+				if (i == *idx) *idx = pos;										\
                                                                              	\
 				while (true) {                                 					\
 					if (new[pos].key == 0) {               						\
@@ -464,7 +477,7 @@ map_dec_strkey(s64, const char *, uint64_t)
 	V map_put_##name(struct map_##name *m, K key, V value)           			\
 	{                                                                      		\
 		V ret;                                                         	\
-		uint32_t pos, mod, h;                                          	\
+		uint32_t pos, mod, h = 0;                                      	\
                                                                     	\
 		m->oom = false;                                                	\
                                                                         \
@@ -486,8 +499,11 @@ map_dec_strkey(s64, const char *, uint64_t)
 				m->found = m->mem[pos].key != 0;                       		\
 				if (!m->found && !map_remap_##name(m, &pos)) {             	\
 					if (m->circular) {										\
+						/* the delete shifts the probe chain, probe again */	\
 						ret = map_del_##name(m, m->head->entry->key);		\
 						m->found = false;									\
+						pos = h & (mod);									\
+						continue;											\
 					} else {												\
 						m->oom = true;                                      \
 						return (V) empty_value;                             \
@@ -526,7 +542,7 @@ map_dec_strkey(s64, const char *, uint64_t)
 			if (m->mem[pos].key == 0) {                            		\
 				m->found = false;                              			\
 				return (V) empty_value;                  				\
-			} else if (!map_cmp_##name(&m->mem[pos], key, h)) { \
+			} else if (map_cmp_##name(&m->mem[pos], key, h)) {  \
 				m->found = true;                                       \
 				map_refresh_or_add_##name(m, true, &m->list[pos]);		\
 				return m->mem[pos].value;                              \
@@ -536,6 +552,32 @@ map_dec_strkey(s64, const char *, uint64_t)
 	}                                                                      \
                                                                                \
 	/** NOLINTNEXTLINE */                                                  \
+	V map_peek_##name(struct map_##name *m, K key)                   	\
+	{                                                                  \
+		const uint32_t mod = m->cap - 1;                               \
+		uint32_t h, pos;                                               \
+                                                                               \
+		if (key == 0) {                                                \
+			m->found = m->used;                                    \
+			return m->used ? m->mem[-1].value : (V) empty_value;                 \
+		}                                                              \
+                                                                               \
+		h = hash_fn(key);                                              \
+		pos = h & mod;                                                 \
+                                                                               \
+		while (true) {                                                 \
+			if (m->mem[pos].key == 0) {                            		\
+				m->found = false;                              			\
+				return (V) empty_value;                  				\
+			} else if (map_cmp_##name(&m->mem[pos], key, h)) {  \
+				m->found = true;                                       \
+				return m->mem[pos].value;                              \
+			}                                                      \
+            pos = (pos + 1) & (mod);                       			\
+		}                                                              \
+	}                                                                      \
+                                                                               \
+	/** NOLINTNEXTLINE */                                                  \
 	V map_del_##name(struct map_##name *m, K key)                    \
 	{                                                                      \
 		const uint32_t mod = m->cap - 1;                               \
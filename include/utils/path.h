@@ -95,5 +95,12 @@ void path_add(char** path, const char* dir) {
 }
 
 #endif
+
+char* getfullpath(const char* filename) {
+    char* path = getcurrentdir();
+    path_add(&path, filename);
+    return path;
+}
+
 #endif
 #endif
\ No newline at end of file
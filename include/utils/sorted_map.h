@@ -91,6 +91,13 @@ typedef struct sorted_map sorted_map;
     ***************************************************************************/  
     void sorted_map_iterator_free (sorted_map_iterator* iterator);
 
+    /***************************************************************************
+    * Calls fn on every mapping in order, without allocating an iterator.      *
+    ***************************************************************************/  
+    void sorted_map_foreach (sorted_map* my_sorted_map,
+                             void (*fn)(void* arg, void* key, void* value),
+                             void* arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -801,6 +808,23 @@ void sorted_map_clear(sorted_map* my_sorted_map)
     my_sorted_map->size = 0;
 }
 
+void sorted_map_foreach(sorted_map* my_sorted_map,
+                        void (*fn)(void* arg, void* key, void* value),
+                        void* arg)
+{
+    sorted_map_entry* entry;
+
+    if (!my_sorted_map || !my_sorted_map->root)
+    {
+        return;
+    }
+
+    for (entry = min_entry(my_sorted_map->root); entry; entry = get_successor_entry(entry))
+    {
+        fn(arg, entry->key, entry->value);
+    }
+}
+
 size_t sorted_map_size(sorted_map* my_sorted_map) 
 {
     return my_sorted_map ? my_sorted_map->size : 0;
@@ -317,10 +317,14 @@ char *str_encode_base64(const char *str) {
 	}
 
 	const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
-    char* encoded = (char*) malloc(len);
-    char *p = encoded; int i;
+    char* encoded = (char*) malloc(4 * ((len + 2) / 3) + 1);
+    char *p = encoded; size_t i;
 
-    for (i = 0; i < len - 2; i += 3) {
+    if (encoded == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i + 2 < len; i += 3) {
         *p++ = base64[(str[i] >> 2) & 0x3F];
         *p++ = base64[((str[i] & 0x3) << 4) | ((int) (str[i + 1] & 0xF0) >> 4)];
         *p++ = base64[((str[i + 1] & 0xF) << 2) | ((int) (str[i + 2] & 0xC0) >> 6)];
@@ -337,9 +341,11 @@ char *str_encode_base64(const char *str) {
         }
     }
 
-    *p++ = '\0';
+    *p = '\0';
 
-	return str_create_len(encoded, len);
+    char* ret = str_create_len(encoded, (uint32_t) (p - encoded));
+    free(encoded);
+    return ret;
 }
 
 void str_destroy(char **arr)
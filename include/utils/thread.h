@@ -104,6 +104,7 @@ void mutex_unlock(struct mutex *mtx);
 
 #if defined(_UTILS_IMPL) || defined(_UTILS_THREAD_IMPL)
 
+#include <assert.h>
 #include <string.h>
 
 void thread_init(struct thread *t)
@@ -1,13 +1,186 @@
 #include <curl/curl.h>
 #include <OAuth.h>
+#include "cache.h"
+#include "spill.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "persist.h"
+#include "keyindex.h"
+
+#include <stdarg.h>
+#include <fcntl.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#define RECORDER_FLAGS (O_WRONLY | O_CREAT | O_TRUNC | O_BINARY)
+#else
+#include <signal.h>
+#include <unistd.h>
+#define RECORDER_FLAGS (O_WRONLY | O_CREAT | O_TRUNC)
+#endif
+
+// Names of the enums declared in OAuth.h
+const char* PARAM_STRING[] = {
+    "save_on_auth",
+    "save_on_close",
+    "refresh_on_auth",
+    "refresh_on_load",
+    "request_on_load",
+    "client_id",
+    "client_secret",
+    "challenge_method",
+    "redirect_uri",
+    "token_url",
+    "auth_url", 
+    "config_file",
+    "cache_file",
+    "request_timeout",
+    "access_token",
+    "token_bearer",
+    "refresh_token",
+    "code_challenge",
+    "code_verifier",
+    "request_queue_size",
+    "cache_size",
+    "request_deadline",
+    "hedge_delay",
+    "breaker_threshold",
+    "breaker_failure_rate",
+    "breaker_cooldown",
+    "cache_policy",
+    "cache_max_bytes",
+    "cache_max_entry_bytes",
+    "spill_file",
+    "spill_max_bytes",
+    "journal_ratio",
+    "persist_interval",
+    "cache_lazy_load",
+    "cache_load_threads"
+};
+
+const char* OPTION_STRING[] = {
+    "request_cache",
+    "request_async",
+    "request_auth",
+    "request_hedge"
+};
+
+const char* POLICY_STRING[] = {
+    "clock",
+    "tinylfu"
+};
+
+const char* REQUEST_STRING[] = {
+    "POST", "PUT", "GET", "PATCH", "DELETE"
+};
+
+const char* PHASE_STRING[] = {
+    "dns",
+    "connect",
+    "tls",
+    "ttfb",
+    "transfer",
+    "upstream",
+    "queue_wait",
+    "cache_lookup",
+    "parse"
+};
+
+const char* BREAKER_STRING[] = {
+    "closed", "open", "half_open"
+};
+
+const char* STAT_STRING[] = {
+    "cache_hits",
+    "cache_misses",
+    "cache_stale_hits",
+    "cache_evictions",
+    "queue_drops",
+    "queue_skipped",
+    "queue_refreshes",
+    "token_refreshes",
+    "token_refresh_failures",
+    "hedges_sent",
+    "hedges_won",
+    "breaker_rejects",
+    "bytes_in",
+    "bytes_out",
+    "cache_oversized",
+    "spill_hits",
+    "spill_writes",
+    "cache_faults",
+    "cache_invalidations"
+};
+
+const char* STATUS_STRING[] = {
+    "error", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+
+const char* LATENCY_STRING[] = {
+    "sync", "async", "queue"
+};
+
+const char* OUTCOME_STRING[] = {
+    "bypass", "hit", "miss", "stale", "rejected", "refresh"
+};
+
+const char* STAGE_STRING[] = {
+    "build", "cache_lookup", "enqueue", "transfer", "parse", "cache_insert", "persist"
+};
 
 #define MAX_BUFFER 2048 //4KB Buffers
+#define LATENCY_SAMPLES 64
+#define BREAKER_WINDOW 20
+#define MAX_HOST 256
+#define STATS_SHARDS 8
+#define RECORDER_MAGIC "OAFR"
+#define RECORDER_VERSION 1
 #define BIT(NUM, N) ((NUM) & (N))
 
-map_dec_strkey(request, const char*, request_data)
-map_dec_strkey(response, const char*, response_data)
-map_def_strkey(request, const char*, request_data, cmp_str, murmurhash, {.id = 0})
-map_def_strkey(response, const char*, response_data, cmp_str, murmurhash, {.data = 0})
+// An unset hook costs one predictable branch, -DOAUTH_NO_TRACE removes it
+#ifdef OAUTH_NO_TRACE
+#define TRACE_REQUEST_BEGIN(oauth, method, endpoint) NULL
+#define TRACE_REQUEST_END(oauth, ctx, response) ((void) (ctx))
+#define TRACE_BEGIN(oauth, ctx, stage) ((void) (ctx))
+#define TRACE_END(oauth, ctx, stage) ((void) (ctx))
+#else
+#define TRACE_REQUEST_BEGIN(oauth, method, endpoint) \
+    ((oauth)->trace.request_begin ? (oauth)->trace.request_begin((oauth)->trace.arg, method, endpoint) : NULL)
+#define TRACE_REQUEST_END(oauth, ctx, response) \
+    do { if ((oauth)->trace.request_end) (oauth)->trace.request_end((oauth)->trace.arg, ctx, response); } while (0)
+#define TRACE_BEGIN(oauth, ctx, stage) \
+    do { if ((oauth)->trace.stage_begin) (oauth)->trace.stage_begin((oauth)->trace.arg, ctx, stage); } while (0)
+#define TRACE_END(oauth, ctx, stage) \
+    do { if ((oauth)->trace.stage_end) (oauth)->trace.stage_end((oauth)->trace.arg, ctx, stage); } while (0)
+#endif
+
+map_dec_scalar(request, uint64_t, request_data)
+map_dec_strkey(breaker, const char*, breaker_data*)
+map_def_scalar(request, uint64_t, request_data, cmp_int, hash_64, {.id = 0})
+map_def_strkey(breaker, const char*, breaker_data*, cmp_str, murmurhash, 0)
+
+// Counters are sharded per thread so the request path never contends on a
+// cache line, oauth_get_stats() sums the shards.
+typedef struct oauth_shard {
+    uint64_t counters[NUM_STATS];
+    uint64_t requests[NUM_REQUESTS][NUM_STATUS];
+    struct histogram latency[NUM_LATENCIES];
+    struct histogram phases[NUM_PHASES];
+} oauth_shard;
+
+// 'seq' is zero while a writer fills the slot, then the record's sequence
+typedef struct recorder_slot {
+    uint64_t seq;
+    record_data record;
+} recorder_slot;
+
+// Cached reads a successful write to 'pattern' makes stale, see
+// oauth_add_invalidation()
+typedef struct invalidation_rule {
+    char* pattern;
+    char* targets;               // space separated
+} invalidation_rule;
+
+#define INVALIDATION_CAPTURES 8
 
 typedef struct OAuth {
     bool authed;
@@ -15,21 +188,366 @@ typedef struct OAuth {
     struct curl_slist* header_slist;
     uint8_t default_options;
     uint8_t current_options;
+    trace_hooks trace;
+    uint64_t default_deadline;
+    uint64_t current_deadline;
+    uint64_t hedge_delay;
+    uint64_t latency[LATENCY_SAMPLES];
+    uint64_t latency_count;
+    uint32_t breaker_threshold;
+    uint32_t breaker_rate;
+    uint64_t breaker_cooldown;
+    struct map_breaker breakers;
+    struct mutex breaker_mutex;
     sorted_map* data;
-    struct map_response cache;
+    char** tags;
+    uint32_t tag_count;
+    invalidation_rule* rules;
+    uint32_t rule_count;
+    struct cache cache;
+    struct key_index keys;
+    struct spill spill;
+    struct snapshot snapshot;
+    struct journal journal;
+    struct persist persist;
     struct map_request request_queue;
+    struct mutex queue_mutex;
     bool request_run;
     struct thread request_thread;
     struct mutex request_mutex;
     struct timer refresh_timer;
+    oauth_shard shards[STATS_SHARDS];
+    recorder_slot recorder[RECORDER_SIZE];
+    uint64_t recorder_head;
+    uint64_t cache_load_us;
 } OAuth;
 
+// defined with the rest of the persistence code at the end
+void oauth_persist(OAuth* oauth, uint64_t what);
+// defined with the cache and request helpers below
+void oauth_cache_evict(void* arg, const char* key, const response_data* value);
+void oauth_clear_tags(OAuth* oauth);
+
 typedef struct data_t {
     char d[MAX_BUFFER];
     struct data_t* next;
     int idx;
 } data_t;
 
+// THIS IS ALL RELATED TO RUNTIME STATS
+
+static THREAD_LOCAL uint32_t stats_slot;
+static uint64_t stats_next;
+
+oauth_shard* oauth_shard_get(OAuth* oauth) {
+    if (!stats_slot) stats_slot = (uint32_t) (atomic_add(&stats_next, 1) % STATS_SHARDS) + 1;
+    return &oauth->shards[stats_slot - 1];
+}
+
+void oauth_count(OAuth* oauth, STAT stat, uint64_t n) {
+    atomic_add(&oauth_shard_get(oauth)->counters[stat], n);
+}
+
+uint64_t oauth_counter(OAuth* oauth, STAT stat) {
+    uint64_t total = 0;
+    for (int i = 0; i < STATS_SHARDS; i++)
+        total += (uint64_t) atomic_get(&oauth->shards[i].counters[stat]);
+    return total;
+}
+
+STATUS status_of(response_data response) {
+    if (!response.data || response.response_code < 100 || response.response_code >= 600)
+        return STATUS_ERROR;
+    return (STATUS) (response.response_code / 100);
+}
+
+void oauth_count_request(OAuth* oauth, REQUEST method, response_data response) {
+    atomic_add(&oauth_shard_get(oauth)->requests[method][status_of(response)], 1);
+}
+
+void oauth_record(OAuth* oauth, LATENCY latency, uint64_t us) {
+    histogram_record(&oauth_shard_get(oauth)->latency[latency], us);
+}
+
+// Phases that did not happen (a cache hit neither queues nor goes upstream,
+// a reused connection skips DNS, connect and TLS) are not recorded.
+void oauth_record_timing(OAuth* oauth, const uint64_t timing[NUM_PHASES]) {
+    oauth_shard* shard = oauth_shard_get(oauth);
+    bool upstream = timing[PHASE_UPSTREAM] != 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        if (i <= PHASE_QUEUE_WAIT && !upstream) continue;
+        if (i < PHASE_TTFB && !timing[i]) continue;
+        histogram_record(&shard->phases[i], timing[i]);
+    }
+}
+
+void oauth_count_transfer(OAuth* oauth, CURL* curl, response_data* response) {
+    long header = 0, sent = 0;
+    curl_off_t body = 0;
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &body);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &sent);
+    response->bytes_in += (uint64_t) header + (uint64_t) body;
+    response->bytes_out += (uint64_t) sent;
+    oauth_count(oauth, BYTES_IN, (uint64_t) header + (uint64_t) body);
+    oauth_count(oauth, BYTES_OUT, (uint64_t) sent);
+}
+
+void oauth_get_stats(OAuth* oauth, oauth_stats* stats) {
+    memset(stats, 0, sizeof(oauth_stats));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        oauth_shard* shard = &oauth->shards[i];
+        for (int j = 0; j < NUM_STATS; j++)
+            stats->counters[j] += (uint64_t) atomic_get(&shard->counters[j]);
+        for (int j = 0; j < NUM_REQUESTS; j++) {
+            for (int k = 0; k < NUM_STATUS; k++)
+                stats->requests[j][k] += (uint64_t) atomic_get(&shard->requests[j][k]);
+        }
+        for (int j = 0; j < NUM_LATENCIES; j++)
+            histogram_merge(&stats->latency[j], &shard->latency[j]);
+        for (int j = 0; j < NUM_PHASES; j++)
+            histogram_merge(&stats->phases[j], &shard->phases[j]);
+    }
+
+    mutex_lock(&oauth->queue_mutex);
+    stats->queue_depth = oauth->request_queue.size;
+    mutex_unlock(&oauth->queue_mutex);
+    stats->cache_entries = cache_size(&oauth->cache);
+    stats->cache_bytes = cache_bytes(&oauth->cache);
+    stats->cache_saved_bytes = cache_saved(&oauth->cache);
+    stats->spill_bytes = spill_bytes(&oauth->spill);
+    stats->cache_load_us = oauth->cache_load_us;
+}
+
+// Fixed size writer used by oauth_stats_format, never allocates. 'len' keeps
+// counting past the end so the caller learns the size it needs.
+typedef struct stats_buf {
+    char* buf;
+    size_t size;
+    size_t len;
+} stats_buf;
+
+void stats_printf(stats_buf* out, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    size_t left = out->len < out->size ? out->size - out->len : 0;
+    int n = vsnprintf(left ? out->buf + out->len : NULL, left, fmt, args);
+    va_end(args);
+    if (n > 0) out->len += n;
+}
+
+// One bucket per power of two keeps the series count fixed and small
+void stats_prometheus_histogram(stats_buf* out, const char* name, const char* label, const char* value, struct histogram* h) {
+    uint64_t count = 0;
+    for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        count += h->buckets[b];
+        if (b % HISTOGRAM_SUB != HISTOGRAM_SUB - 1 || b == HISTOGRAM_BUCKETS - 1) continue;
+        stats_printf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label, value,
+                     (double) (histogram_upper(b) + 1) / 1e6, (unsigned long long) count);
+    }
+    // the bucket total, not h->count, so +Inf matches the buckets read
+    stats_printf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, (unsigned long long) count);
+    stats_printf(out, "%s_sum{%s=\"%s\"} %g\n", name, label, value, (double) h->sum / 1e6);
+    stats_printf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long) count);
+}
+
+void stats_prometheus(stats_buf* out, oauth_stats* stats) {
+    stats_printf(out, "# TYPE oauth_requests_total counter\n");
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        for (int j = 0; j < NUM_STATUS; j++)
+            stats_printf(out, "oauth_requests_total{method=\"%s\",status=\"%s\"} %llu\n",
+                         REQUEST_STRING[i], STATUS_STRING[j], (unsigned long long) stats->requests[i][j]);
+    }
+
+    for (int i = 0; i < NUM_STATS; i++) {
+        stats_printf(out, "# TYPE oauth_%s_total counter\noauth_%s_total %llu\n",
+                     STAT_STRING[i], STAT_STRING[i], (unsigned long long) stats->counters[i]);
+    }
+
+    stats_printf(out, "# TYPE oauth_queue_depth gauge\noauth_queue_depth %llu\n", (unsigned long long) stats->queue_depth);
+    stats_printf(out, "# TYPE oauth_cache_entries gauge\noauth_cache_entries %llu\n", (unsigned long long) stats->cache_entries);
+    stats_printf(out, "# TYPE oauth_cache_bytes gauge\noauth_cache_bytes %llu\n", (unsigned long long) stats->cache_bytes);
+    stats_printf(out, "# TYPE oauth_cache_dedup_saved_bytes gauge\noauth_cache_dedup_saved_bytes %llu\n",
+                 (unsigned long long) stats->cache_saved_bytes);
+    stats_printf(out, "# TYPE oauth_spill_bytes gauge\noauth_spill_bytes %llu\n", (unsigned long long) stats->spill_bytes);
+    stats_printf(out, "# TYPE oauth_cache_load_seconds gauge\noauth_cache_load_seconds %g\n", (double) stats->cache_load_us / 1e6);
+
+    stats_printf(out, "# TYPE oauth_latency_seconds histogram\n");
+    for (int i = 0; i < NUM_LATENCIES; i++)
+        stats_prometheus_histogram(out, "oauth_latency_seconds", "path", LATENCY_STRING[i], &stats->latency[i]);
+
+    stats_printf(out, "# TYPE oauth_phase_seconds histogram\n");
+    for (int i = 0; i < NUM_PHASES; i++)
+        stats_prometheus_histogram(out, "oauth_phase_seconds", "phase", PHASE_STRING[i], &stats->phases[i]);
+}
+
+void stats_json_histogram(stats_buf* out, bool first, const char* name, struct histogram* h) {
+    stats_printf(out, "%s\"%s\":{\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu,"
+                 "\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"buckets\":[",
+                 first ? "" : ",", name, (unsigned long long) h->count,
+                 (unsigned long long) h->sum, (unsigned long long) h->max,
+                 (unsigned long long) histogram_percentile(h, 50.0),
+                 (unsigned long long) histogram_percentile(h, 90.0),
+                 (unsigned long long) histogram_percentile(h, 99.0),
+                 (unsigned long long) histogram_percentile(h, 99.9));
+
+    // sparse [upper_us, count] pairs
+    first = true;
+    for (uint32_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        if (!h->buckets[b]) continue;
+        stats_printf(out, "%s[%llu,%llu]", first ? "" : ",",
+                     (unsigned long long) histogram_upper(b), (unsigned long long) h->buckets[b]);
+        first = false;
+    }
+    stats_printf(out, "]}");
+}
+
+void stats_json(stats_buf* out, oauth_stats* stats) {
+    stats_printf(out, "{\"requests\":{");
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        stats_printf(out, "%s\"%s\":{", i ? "," : "", REQUEST_STRING[i]);
+        for (int j = 0; j < NUM_STATUS; j++)
+            stats_printf(out, "%s\"%s\":%llu", j ? "," : "", STATUS_STRING[j], (unsigned long long) stats->requests[i][j]);
+        stats_printf(out, "}");
+    }
+
+    stats_printf(out, "},\"counters\":{");
+    for (int i = 0; i < NUM_STATS; i++)
+        stats_printf(out, "%s\"%s\":%llu", i ? "," : "", STAT_STRING[i], (unsigned long long) stats->counters[i]);
+
+    stats_printf(out, "},\"queue_depth\":%llu,\"cache_entries\":%llu,\"cache_bytes\":%llu,\"cache_dedup_saved_bytes\":%llu,"
+                 "\"spill_bytes\":%llu,\"cache_load_us\":%llu,\"latency\":{",
+                 (unsigned long long) stats->queue_depth, (unsigned long long) stats->cache_entries,
+                 (unsigned long long) stats->cache_bytes, (unsigned long long) stats->cache_saved_bytes,
+                 (unsigned long long) stats->spill_bytes, (unsigned long long) stats->cache_load_us);
+    for (int i = 0; i < NUM_LATENCIES; i++)
+        stats_json_histogram(out, i == 0, LATENCY_STRING[i], &stats->latency[i]);
+
+    stats_printf(out, "},\"phases\":{");
+    for (int i = 0; i < NUM_PHASES; i++)
+        stats_json_histogram(out, i == 0, PHASE_STRING[i], &stats->phases[i]);
+    stats_printf(out, "}}");
+}
+
+size_t oauth_stats_format(OAuth* oauth, FORMAT format, char* buf, size_t size) {
+    oauth_stats stats;
+    stats_buf out = {.buf = buf, .size = size, .len = 0};
+    if (buf && size) buf[0] = '\0';
+    if (!buf) out.size = 0;
+
+    oauth_get_stats(oauth, &stats);
+    if (format == OAUTH_FMT_JSON) stats_json(&out, &stats);
+    else stats_prometheus(&out, &stats);
+    return out.len;
+}
+
+// THIS IS ALL RELATED TO THE FLIGHT RECORDER
+
+uint32_t clamp_u32(uint64_t v) {
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t) v;
+}
+
+// Writers claim a slot with one atomic add and publish it seqlock style, a
+// writer lapping a slow one may still tear a record, the recorder is a
+// diagnostic and does not guard against it.
+void oauth_recorder_put(OAuth* oauth, REQUEST method, const char* endpoint, OUTCOME outcome,
+                        response_data* response, uint64_t latency) {
+    uint64_t ticket = atomic_add(&oauth->recorder_head, 1);
+    recorder_slot* slot = &oauth->recorder[ticket % RECORDER_SIZE];
+    atomic_set(&slot->seq, 0);
+    atomic_fence();
+
+    record_data* record = &slot->record;
+    record->seq = ticket + 1;
+    record->time = time_mono_ms();
+    record->endpoint = murmurhash(endpoint);
+    record->status = (uint16_t) (response->data ? response->response_code : 0);
+    record->method = (uint8_t) method;
+    record->outcome = (uint8_t) outcome;
+    record->latency = clamp_u32(latency);
+    for (int i = 0; i < NUM_PHASES; i++)
+        record->timing[i] = clamp_u32(response->timing[i]);
+    record->bytes_in = response->bytes_in;
+    record->bytes_out = response->bytes_out;
+    atomic_set(&slot->seq, ticket + 1);
+}
+
+// Copy the record of sequence 'seq' if it is still in the ring and complete
+bool oauth_recorder_read(OAuth* oauth, uint64_t seq, record_data* record) {
+    recorder_slot* slot = &oauth->recorder[(seq - 1) % RECORDER_SIZE];
+    if ((uint64_t) atomic_get(&slot->seq) != seq) return false;
+    *record = slot->record;
+    atomic_fence();
+    return (uint64_t) atomic_get(&slot->seq) == seq;
+}
+
+size_t oauth_recorder_snapshot(OAuth* oauth, record_data* records, size_t max) {
+    uint64_t head = (uint64_t) atomic_get(&oauth->recorder_head);
+    uint64_t seq = head > RECORDER_SIZE ? head - RECORDER_SIZE + 1 : 1;
+    if (head - seq + 1 > max) seq = head - max + 1;
+
+    size_t n = 0;
+    for (; seq <= head && n < max; seq++)
+        n += oauth_recorder_read(oauth, seq, &records[n]);
+    return n;
+}
+
+// Only uses open/write so it can run inside a signal handler. The file is a
+// header (magic, version, record size, capacity as uint32) followed by the
+// records oldest first, until the end of the file.
+bool oauth_recorder_dump(OAuth* oauth, const char* file) {
+    uint32_t header[4] = {0, RECORDER_VERSION, sizeof(record_data), RECORDER_SIZE};
+    memcpy(&header[0], RECORDER_MAGIC, 4);
+
+    int fd = open(file, RECORDER_FLAGS, 0644);
+    if (fd < 0) return false;
+
+    bool ok = write(fd, header, sizeof(header)) == sizeof(header);
+    uint64_t head = (uint64_t) atomic_get(&oauth->recorder_head);
+    uint64_t seq = head > RECORDER_SIZE ? head - RECORDER_SIZE + 1 : 1;
+    for (record_data record; ok && seq <= head; seq++) {
+        if (oauth_recorder_read(oauth, seq, &record))
+            ok = write(fd, &record, sizeof(record)) == sizeof(record);
+    }
+    close(fd);
+    return ok;
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+bool oauth_recorder_on_signal(OAuth* oauth, int signum, const char* file) {
+    return false;
+}
+
+#else
+
+static OAuth* recorder_oauth;
+static char recorder_file[1024];
+
+void oauth_recorder_signal(int signum) {
+    if (recorder_oauth) oauth_recorder_dump(recorder_oauth, recorder_file);
+}
+
+// Dump the recorder to 'file' every time 'signum' (e.g. SIGUSR1) is raised.
+// There is a single handler per process, NULL 'oauth' removes it.
+bool oauth_recorder_on_signal(OAuth* oauth, int signum, const char* file) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = SIG_DFL;
+
+    if (oauth) {
+        if (!file || strlen(file) >= sizeof(recorder_file)) return false;
+        strcpy(recorder_file, file);
+        action.sa_handler = oauth_recorder_signal;
+    }
+    recorder_oauth = oauth;
+    return sigaction(signum, &action, NULL) == 0;
+}
+
+#endif
+
 // THIS IS ALL RELATED TO GET AND HTTPS RESPONSE AND PROCESS THE STRING DATA
 
 data_t* data_create() {
@@ -107,6 +625,35 @@ size_t process_response(void *ptr, size_t size, size_t nmemb, void *userdata) {
 
 // THIS IS ALL RELATED TO HEADER AND DATA
 
+struct request_key {
+    struct Murmur_128 murmur;
+    bool first;
+};
+
+void request_key_param(void* arg, void* key, void* value) {
+    struct request_key* k = (struct request_key*) arg;
+    murmur_128_write(&k->murmur, k->first ? "?" : "&", 1);
+    murmur_128_write(&k->murmur, key, strlen((const char*) key));
+    murmur_128_write(&k->murmur, "=", 1);
+    murmur_128_write(&k->murmur, value, strlen((const char*) value));
+    k->first = false;
+}
+
+// Hashes the bytes request_format() would write, the key equals
+// cache_key_of(id) so persisted entries are found again
+cache_key request_key(REQUEST method, const char* endpoint, sorted_map* data) {
+    struct request_key k = {.first = true};
+    uint64_t hash[2];
+    murmur_128_init(&k.murmur, 0);
+    murmur_128_write(&k.murmur, "/", 1);
+    murmur_128_write(&k.murmur, REQUEST_STRING[method], strlen(REQUEST_STRING[method]));
+    murmur_128_write(&k.murmur, "/", 1);
+    murmur_128_write(&k.murmur, endpoint, strlen(endpoint));
+    sorted_map_foreach(data, request_key_param, &k);
+    murmur_128_close(&k.murmur, hash);
+    return (cache_key) {.lo = hash[0], .hi = hash[1]};
+}
+
 char* parse_data(sorted_map* data, const char* data_join) {
     if (!data) return NULL;
     char* key; char* value;  
@@ -120,52 +667,167 @@ char* parse_data(sorted_map* data, const char* data_join) {
     return data_str;
 }
 
-response_data request(REQUEST method, const char* endpoint, struct curl_slist* header, const char* data) {
+// The body and id are only formatted once a miss or refresh needs them
+void request_format(sorted_map* data, request_data* rq_data) {
+    if (rq_data->id) return;
+    rq_data->data = parse_data(data, "&");
+    str_append_fmt(&rq_data->id, "/%s/%s", REQUEST_STRING[rq_data->method], rq_data->endpoint);
+    if (rq_data->data) str_append_fmt(&rq_data->id, "?%s", rq_data->data);
+}
+
+void request_release(request_data* rq_data) {
+    str_destroy((char**) &rq_data->id);
+    str_destroy((char**) &rq_data->data);
+}
+
+CURL* request_handle(REQUEST method, const char* endpoint, struct curl_slist* header, const char* data, data_t* storage) {
+    CURL *curl = curl_easy_init();
+    if (!curl) return NULL;
+
+    // Set the URL, header and callback function
+    if (header != NULL) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, process_response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, storage);
+
+    /* Now specify the POST/DELETE/PUT/ data */
     char* new_endpoint = str_create(endpoint);
+    if (method != GET) { 
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, REQUEST_STRING[method]);
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, data);
+    } else if (data) str_append_fmt(&new_endpoint, "?%s", data);
+
+    // curl keeps its own copy of the url
+    curl_easy_setopt(curl, CURLOPT_URL, new_endpoint);
+    str_destroy(&new_endpoint);
+    return curl;
+}
+
+uint64_t elapsed_us(curl_off_t from, curl_off_t to) {
+    return to > from ? (uint64_t) (to - from) : 0;
+}
+
+// curl reports every time as an offset from the start of the transfer
+void request_timing(CURL* curl, uint64_t timing[NUM_PHASES]) {
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, ttfb = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    timing[PHASE_DNS] = (uint64_t) dns;
+    timing[PHASE_CONNECT] = elapsed_us(dns, connect);
+    timing[PHASE_TLS] = tls ? elapsed_us(connect, tls) : 0;
+    timing[PHASE_TTFB] = elapsed_us(pretransfer, ttfb);
+    timing[PHASE_TRANSFER] = elapsed_us(ttfb, total);
+    timing[PHASE_UPSTREAM] = total > 0 ? (uint64_t) total : 1;
+}
+
+response_data request_result(CURL* curl, data_t* storage) {
+    response_data response = {.data = 0};
+    uint64_t start = time_mono_ns();
+    response.data = process_response_data(storage);
+    response.timing[PHASE_PARSE] = (time_mono_ns() - start) / 1000;
+    response.response_code = 0;
+    response.time = time_mono_ms();
+    request_timing(curl, response.timing);
+
+    // get response code and content type
+    curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response.response_code);
+    const char* content = NULL;
+    curl_easy_getinfo (curl, CURLINFO_CONTENT_TYPE, &content);
+    response.content_type = strdup(content ? content : "");
+    return response;
+}
+
+response_data request(OAuth* oauth, REQUEST method, const char* endpoint, struct curl_slist* header, const char* data) {
     data_t* storage = data_create();
-    response_data response;
+    response_data response = {.data = 0};
 
     curl_global_init(CURL_GLOBAL_ALL);
-    CURL *curl = curl_easy_init();
+    CURL *curl = request_handle(method, endpoint, header, data, storage);
     if (curl) {
-        // Set the URL, header and callback function
-        if (header != NULL) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, process_response);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, storage);
-              
-        /* Now specify the POST/DELETE/PUT/ data */
-        if (method != GET) { 
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, REQUEST_STRING[method]);
-            curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, data);
-        } else str_append_fmt(&new_endpoint, "?%s", data);
-        
-        curl_easy_setopt(curl, CURLOPT_URL, new_endpoint);
-
         /* Perform the request, res will get the return code */
         CURLcode res;
         if((res = curl_easy_perform(curl)) != CURLE_OK) {
             fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            curl_easy_cleanup(curl);
-            curl_global_cleanup();
-            data_clean(storage);
-            return (response_data) {.data = 0};
-        }
-
-        response.data = process_response_data(storage);
-        response.response_code == 0;
+            request_timing(curl, response.timing);
+        } else response = request_result(curl, storage);
+        oauth_count_transfer(oauth, curl, &response);
 
-        // get response code and content type
-        curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response.response_code);
-        const char* content;
-        curl_easy_getinfo (curl, CURLINFO_CONTENT_TYPE, &content);
-        response.content_type = strdup(content);
-
-        /* Check for errors */
         /* always cleanup */
         curl_easy_cleanup(curl);
-        data_clean(storage);
-        str_destroy(&new_endpoint);
     } 
+    data_clean(storage);
+    curl_global_cleanup();
+    return response;
+}
+
+// Issue a GET and, if it is still running after 'delay' ms, a second identical
+// one on a fresh connection. The first successful transfer wins, the other is
+// cancelled.
+response_data request_hedged(OAuth* oauth, const char* endpoint, struct curl_slist* header, const char* data, uint64_t delay) {
+    data_t* storage[2] = {data_create(), data_create()};
+    CURL* curl[2] = {NULL, NULL};
+    CURL* winner = NULL;
+    response_data response = {.data = 0};
+    int running = 0, failed = 0, sent = 1;
+    bool hedged = false;    // tried once, a handle that failed is not retried
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    CURLM* multi = curl_multi_init();
+    curl[0] = request_handle(GET, endpoint, header, data, storage[0]);
+    if (!multi || !curl[0]) goto cleanup;
+    curl_multi_add_handle(multi, curl[0]);
+
+    uint64_t start = time_mono_ms();
+    while (!winner && failed < sent) {
+        curl_multi_perform(multi, &running);
+
+        CURLMsg* msg; int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            if (msg->data.result == CURLE_OK) {
+                winner = msg->easy_handle;
+                break;
+            }
+            fprintf(stderr, "curl_multi_perform() failed: %s\n", curl_easy_strerror(msg->data.result));
+            failed++;
+        }
+        if (winner || failed == sent) break;
+
+        uint64_t elapsed = time_mono_ms() - start;
+        if (!hedged && elapsed >= delay) {
+            hedged = true;
+            curl[1] = request_handle(GET, endpoint, header, data, storage[1]);
+            if (curl[1]) {
+                curl_easy_setopt(curl[1], CURLOPT_FRESH_CONNECT, 1L);
+                curl_multi_add_handle(multi, curl[1]);
+                oauth_count(oauth, HEDGES_SENT, 1);
+                sent++;
+            }
+        }
+
+        int wait = !hedged ? (int) (delay - elapsed) : 100;
+        curl_multi_wait(multi, NULL, 0, wait > 0 ? wait : 1, NULL);
+    }
+
+    if (winner) {
+        int i = (winner == curl[1]);
+        oauth_count(oauth, HEDGES_WON, i);
+        response = request_result(winner, storage[i]);
+    }
+
+cleanup:
+    for (int i = 0; i < 2; i++) {
+        if (curl[i]) {
+            oauth_count_transfer(oauth, curl[i], &response);
+            curl_multi_remove_handle(multi, curl[i]);
+            curl_easy_cleanup(curl[i]);
+        } data_clean(storage[i]);
+    }
+    if (multi) curl_multi_cleanup(multi);
     curl_global_cleanup();
     return response;
 }
@@ -175,13 +837,17 @@ OAuth* oauth_create(const char* config_file) {
     oauth->authed = false;
     oauth->request_run = false;
     map_init_request(&oauth->request_queue, 0, 0);
-    map_init_response(&oauth->cache, 0, 0);
-    map_set_circular(&oauth->cache, true);
-    map_set_refresh(&oauth->cache, true);
+    cache_init(&oauth->cache, 200, POLICY_CLOCK);
+    cache_set_evict(&oauth->cache, oauth_cache_evict, oauth);
+    key_index_init(&oauth->keys);
     map_set_refresh(&oauth->request_queue, true);
     map_set_max_size(&oauth->request_queue, 200);
-    map_set_max_size(&oauth->cache, 200);
     mutex_init(&oauth->request_mutex);
+    mutex_init(&oauth->queue_mutex);
+    map_init_breaker(&oauth->breakers, 0, 0);
+    map_set_max_size(&oauth->breakers, UINT32_MAX);
+    mutex_init(&oauth->breaker_mutex);
+    oauth->breaker_cooldown = 30000;
     oauth->data = NULL;
     oauth->header_slist = NULL;
 
@@ -195,12 +861,35 @@ OAuth* oauth_create(const char* config_file) {
 
 void oauth_delete(OAuth* oauth) {
     oauth_stop_request_thread(oauth);
+    persist_stop(&oauth->persist);
     if (oauth->args[SAVE_ON_CLOSE])
         oauth_save(oauth);
+    // refreshes still queued own their strings
+    uint64_t key; request_data queued;
+    map_foreach(&oauth->request_queue, key, queued)
+        request_release(&queued);
     map_term_request(&oauth->request_queue);
-    map_term_response(&oauth->cache);
+    journal_close(&oauth->journal);
+    cache_term(&oauth->cache);
+    key_index_term(&oauth->keys);
+    spill_close(&oauth->spill);
+    snapshot_close(&oauth->snapshot);
     mutex_term(&oauth->request_mutex);
+    mutex_term(&oauth->queue_mutex);
+    const char* host; breaker_data* breaker;
+    map_foreach(&oauth->breakers, host, breaker) {
+        free((char*) host);
+        free(breaker);
+    }
+    map_term_breaker(&oauth->breakers);
+    mutex_term(&oauth->breaker_mutex);
     if (oauth->data) sorted_map_free(oauth->data);
+    oauth_clear_tags(oauth);
+    for (uint32_t i = 0; i < oauth->rule_count; i++) {
+        free(oauth->rules[i].pattern);
+        free(oauth->rules[i].targets);
+    }
+    free(oauth->rules);
     if (oauth->args[CODE_CHALLENGE]) str_destroy(&oauth->args[CODE_CHALLENGE]);
     if (oauth->args[CODE_VERIFIER]) str_destroy(&oauth->args[CODE_VERIFIER]);
     if (oauth->header_slist) curl_slist_free_all(oauth->header_slist);
@@ -211,14 +900,16 @@ void* oauth_parse_auth(OAuth* oauth, response_data response) {
     
     enum { MAX_FIELDS = 512 };
     json_t pool[ MAX_FIELDS ];
+    TRACE_BEGIN(oauth, NULL, STAGE_PARSE);
     const json_t* json = json_create(response.data, pool, MAX_FIELDS);
+    TRACE_END(oauth, NULL, STAGE_PARSE);
     oauth->args[TOKEN_BEARER] = json_value(json, "token_type").string;
     oauth->args[ACCESS_TOKEN] = json_value(json, "access_token").string;
     oauth->args[REFRESH_TOKEN] = json_value(json, "refresh_token").string;
     oauth->authed = true;
 
     if (oauth->args[SAVE_ON_OAUTH])
-        oauth_save(oauth);
+        oauth_persist(oauth, PERSIST_CONFIG | PERSIST_CACHE);
 
     if (oauth->args[REFRESH_ON_OAUTH])
         oauth_start_refresh(oauth, (json_value(json, "expires_in").integer * 2000)/3);
@@ -240,8 +931,9 @@ void* oauth_refresh_task(void* in) {
     response_data response = oauth_request(oauth, POST, oauth->args[TOKEN_URL]);
 
     if (response.data && response.response_code == 200) {
+        oauth_count(oauth, TOKEN_REFRESHES, 1);
         oauth_parse_auth(oauth, response);
-    }
+    } else oauth_count(oauth, TOKEN_REFRESH_FAILURES, 1);
 }
 
 bool oauth_start_refresh(OAuth* oauth, uint64_t ms) {
@@ -331,11 +1023,21 @@ void oauth_set_param(OAuth* oauth, PARAM param, char* value) {
 }
 
 bool oauth_set_options(OAuth* oauth, uint8_t options) {
-    if (options > 7) return false;
+    if (options >= (1 << NUM_OPTIONS)) return false;
     oauth->current_options = options;
     return true;
 }
 
+// Not synchronized with running requests, set the hooks before issuing any
+void oauth_set_trace(OAuth* oauth, const trace_hooks* hooks) {
+    if (hooks) oauth->trace = *hooks;
+    else memset(&oauth->trace, 0, sizeof(trace_hooks));
+}
+
+void oauth_set_deadline(OAuth* oauth, uint64_t ms) {
+    oauth->current_deadline = ms;
+}
+
 void oauth_append_header(OAuth* oauth, const char* key, const char* value) {
     char* val = str_create_fmt("%s:%s", key, value);
     oauth->header_slist = curl_slist_append(oauth->header_slist, val);
@@ -346,18 +1048,312 @@ void oauth_append_data(OAuth* oauth, const char* key, const char* value) {
     sorted_map_put(oauth->data, key, value);
 }
 
+void oauth_append_tag(OAuth* oauth, const char* tag) {
+    oauth->tags = realloc(oauth->tags, (oauth->tag_count + 1) * sizeof(char*));
+    oauth->tags[oauth->tag_count++] = strdup(tag);
+}
+
+void oauth_add_invalidation(OAuth* oauth, const char* pattern, const char* targets) {
+    for (uint32_t i = 0; i < oauth->rule_count; i++) {
+        if (strcmp(oauth->rules[i].pattern, pattern)) continue;
+        char* joined = malloc(strlen(oauth->rules[i].targets) + strlen(targets) + 2);
+        sprintf(joined, "%s %s", oauth->rules[i].targets, targets);
+        free(oauth->rules[i].targets);
+        oauth->rules[i].targets = joined;
+        return;
+    }
+    oauth->rules = realloc(oauth->rules, (oauth->rule_count + 1) * sizeof(invalidation_rule));
+    oauth->rules[oauth->rule_count++] = (invalidation_rule) {strdup(pattern), strdup(targets)};
+}
+
+void oauth_clear_tags(OAuth* oauth) {
+    for (uint32_t i = 0; i < oauth->tag_count; i++)
+        free(oauth->tags[i]);
+    free(oauth->tags);
+    oauth->tags = NULL;
+    oauth->tag_count = 0;
+}
+
+// THIS IS ALL RELATED TO THE PER HOST CIRCUIT BREAKER
+
+void host_of(const char* endpoint, char host[MAX_HOST]) {
+    const char* begin = strstr(endpoint, "://");
+    begin = begin ? begin + 3 : endpoint;
+    size_t len = strcspn(begin, "/?#");
+    if (len >= MAX_HOST) len = MAX_HOST - 1;
+    memcpy(host, begin, len);
+    host[len] = '\0';
+}
+
+bool oauth_breaker_enabled(OAuth* oauth) {
+    return oauth->breaker_threshold || oauth->breaker_rate;
+}
+
+breaker_data* oauth_breaker_get(OAuth* oauth, const char* host) {
+    breaker_data* breaker = map_peek_breaker(&oauth->breakers, host);
+    if (!breaker) {
+        breaker = (breaker_data*) calloc(1, sizeof(breaker_data));
+        map_put_breaker(&oauth->breakers, strdup(host), breaker);
+    } return breaker;
+}
+
+// Whether a request to host may go upstream. An open breaker lets a single
+// half open probe through once the cooldown elapsed.
+bool oauth_breaker_allow(OAuth* oauth, const char* host) {
+    if (!oauth_breaker_enabled(oauth)) return true;
+
+    bool allow = true;
+    mutex_lock(&oauth->breaker_mutex);
+    breaker_data* breaker = oauth_breaker_get(oauth, host);
+    if (breaker->state == BREAKER_OPEN && time_mono_ms() - breaker->opened >= oauth->breaker_cooldown) {
+        breaker->state = BREAKER_HALF_OPEN;
+        breaker->probing = false;
+    }
+    if (breaker->state == BREAKER_HALF_OPEN) {
+        allow = !breaker->probing;
+        breaker->probing = true;
+    } else allow = breaker->state == BREAKER_CLOSED;
+    mutex_unlock(&oauth->breaker_mutex);
+    return allow;
+}
+
+void oauth_breaker_record(OAuth* oauth, const char* host, response_data response) {
+    if (!oauth_breaker_enabled(oauth)) return;
+
+    bool failed = !response.data || response.response_code >= 500;
+    mutex_lock(&oauth->breaker_mutex);
+    breaker_data* breaker = oauth_breaker_get(oauth, host);
+
+    if (breaker->state == BREAKER_HALF_OPEN) {
+        *breaker = (breaker_data) {.state = failed ? BREAKER_OPEN : BREAKER_CLOSED};
+        breaker->opened = failed ? time_mono_ms() : 0;
+    } else {
+        breaker->consecutive_failures = failed ? breaker->consecutive_failures + 1 : 0;
+        breaker->window_requests++;
+        breaker->window_failures += failed;
+
+        bool trip = oauth->breaker_threshold && breaker->consecutive_failures >= oauth->breaker_threshold;
+        if (breaker->window_requests >= BREAKER_WINDOW) {
+            trip |= oauth->breaker_rate && breaker->window_failures * 100 >= oauth->breaker_rate * breaker->window_requests;
+            breaker->window_requests = breaker->window_failures = 0;
+        }
+        if (trip && breaker->state == BREAKER_CLOSED) {
+            breaker->state = BREAKER_OPEN;
+            breaker->opened = time_mono_ms();
+        }
+    }
+    mutex_unlock(&oauth->breaker_mutex);
+}
+
+breaker_data oauth_breaker(OAuth* oauth, const char* host) {
+    char name[MAX_HOST];
+    breaker_data ret = {.state = BREAKER_CLOSED};
+    host_of(host, name);
+    mutex_lock(&oauth->breaker_mutex);
+    breaker_data* breaker = map_peek_breaker(&oauth->breakers, name);
+    if (breaker) ret = *breaker;
+    mutex_unlock(&oauth->breaker_mutex);
+    return ret;
+}
+
+// A key the disk tier lost is forgotten by the index unless it is cached again
+void oauth_spill_drop(void* arg, const char* key) {
+    OAuth* oauth = (OAuth*) arg;
+    response_data cached;
+    if (!cache_peek(&oauth->cache, key, &cached)) key_index_remove(&oauth->keys, key);
+}
+
+// Drops a key from the cache, the disk tier and the snapshot alike, a record
+// a lazy load has not faulted in counts as found too
+bool oauth_cache_drop(OAuth* oauth, const char* key) {
+    response_data unloaded;
+    bool found = cache_del(&oauth->cache, key);
+    found = spill_del(&oauth->spill, key) || found;
+    if (oauth->journal.base) found = snapshot_take(oauth->journal.base, key, &unloaded) || found;
+    journal_del(&oauth->journal, key);
+    return found;
+}
+
+// The policy evicts once the cache is over its entry count or byte budget,
+// responses too large for it are not cached at all. The cache keeps its own
+// copy, 'response' stays owned by the caller.
+void oauth_cache_put(OAuth* oauth, const char* id, response_data* response, bool mapped) {
+    if (cache_oversized(&oauth->cache, id, *response)) {
+        // the copy kept so far is stale, nothing replaces it
+        oauth_count(oauth, CACHE_OVERSIZED, 1);
+        oauth_cache_drop(oauth, id);
+        key_index_remove(&oauth->keys, id);
+        if (oauth->journal.path) oauth_persist(oauth, PERSIST_CACHE);
+        return;
+    }
+    uint32_t evicted = mapped ? cache_put_mapped(&oauth->cache, id, *response) : cache_put(&oauth->cache, id, *response);
+    if (evicted) oauth_count(oauth, CACHE_EVICTIONS, evicted);
+    journal_put(&oauth->journal, id, response);
+    if (oauth->journal.path) oauth_persist(oauth, PERSIST_CACHE);
+    key_index_add(&oauth->keys, id, NULL, 0);
+}
+
+// Evicted entries move to the disk tier when there is one, and are only
+// forgotten by the invalidation index once they are gone from every tier.
+// This runs under the shard lock, the persistence thread does the writing.
+void oauth_cache_evict(void* arg, const char* key, const response_data* value) {
+    OAuth* oauth = (OAuth*) arg;
+    if (spill_defer(&oauth->spill, key, value))
+        persist_mark(&oauth->persist, PERSIST_SPILL);
+    else key_index_remove(&oauth->keys, key);
+}
+
+uint32_t oauth_cache_drop_all(OAuth* oauth, char** keys, uint32_t count) {
+    uint32_t dropped = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        dropped += oauth_cache_drop(oauth, keys[i]);
+        free(keys[i]);
+    }
+    free(keys);
+    return dropped;
+}
+
+uint32_t oauth_cache_invalidate_prefix(OAuth* oauth, const char* prefix) {
+    char** keys;
+    uint32_t count = key_index_take_prefix(&oauth->keys, prefix, &keys);
+    uint32_t dropped = oauth_cache_drop_all(oauth, keys, count);
+    if (dropped) oauth_count(oauth, CACHE_INVALIDATIONS, dropped);
+    if (dropped && oauth->journal.path) oauth_persist(oauth, PERSIST_CACHE);
+    return dropped;
+}
+
+uint32_t oauth_cache_invalidate_tag(OAuth* oauth, const char* tag) {
+    char** keys;
+    uint32_t count = key_index_take_tag(&oauth->keys, tag, &keys);
+    uint32_t dropped = oauth_cache_drop_all(oauth, keys, count);
+    if (dropped) oauth_count(oauth, CACHE_INVALIDATIONS, dropped);
+    if (dropped && oauth->journal.path) oauth_persist(oauth, PERSIST_CACHE);
+    return dropped;
+}
+
+// Matches a rule pattern against the start of a path on segment boundaries,
+// every '*' takes one segment. Returns the number of captures, -1 on no match.
+int invalidation_match(const char* pattern, const char* path, size_t len, const char* caps[], size_t cap_len[]) {
+    const char* end = path + len;
+    int count = 0;
+
+    if (!*pattern) return -1;
+    for (const char* p = pattern; *p; p++) {
+        if (*p == '*') {
+            const char* seg = path;
+            while (path < end && *path != '/') path++;
+            if (path == seg) return -1;
+            if (count < INVALIDATION_CAPTURES) {
+                caps[count] = seg;
+                cap_len[count++] = path - seg;
+            }
+        } else if (path == end || *p != *path++) return -1;
+    } return path == end || *path == '/' || pattern[strlen(pattern) - 1] == '/' ? count : -1;
+}
+
+// Origin of the write followed by a target with the captures in place of its '*'
+char* invalidation_target(const char* origin, size_t origin_len, const char* target, size_t len,
+                          const char* caps[], const size_t cap_len[], int count) {
+    size_t size = origin_len + len + 1;
+    for (int i = 0; i < count; i++)
+        size += cap_len[i];
+    char* out = malloc(size);
+    char* w = out + origin_len;
+    int next = 0;
+
+    memcpy(out, origin, origin_len);
+    for (size_t i = 0; i < len; i++) {
+        if (target[i] != '*' || next == count) *w++ = target[i];
+        else {
+            memcpy(w, caps[next], cap_len[next]);
+            w += cap_len[next++];
+        }
+    }
+    *w = '\0';
+    return out;
+}
+
+// A successful write leaves the cached reads of the resource it wrote stale,
+// they are dropped rather than refreshed so nothing is fetched that is never
+// read again. The endpoint's own path always goes, the rules add the paths
+// that embed it, e.g. the lists an update of one item shows up in.
+uint32_t oauth_invalidate_write(OAuth* oauth, const char* endpoint) {
+    const char* scheme = strstr(endpoint, "://");
+    const char* path = scheme ? strchr(scheme + 3, '/') : endpoint;
+    size_t origin_len = path ? path - endpoint : strcspn(endpoint, "?");
+    size_t len = path ? strcspn(path, "?") : 0;
+    const char* caps[INVALIDATION_CAPTURES];
+    size_t cap_len[INVALIDATION_CAPTURES];
+
+    char* own = invalidation_target(endpoint, origin_len, path, len, NULL, NULL, 0);
+    uint32_t dropped = oauth_cache_invalidate_prefix(oauth, own);
+    free(own);
+
+    for (uint32_t i = 0; path && i < oauth->rule_count; i++) {
+        int count = invalidation_match(oauth->rules[i].pattern, path, len, caps, cap_len);
+        for (const char* t = oauth->rules[i].targets; count >= 0 && *t; ) {
+            size_t n = strcspn(t, " \t,");
+            if (n) {
+                char* prefix = invalidation_target(endpoint, origin_len, t, n, caps, cap_len, count);
+                dropped += oauth_cache_invalidate_prefix(oauth, prefix);
+                free(prefix);
+            }
+            t += n + (t[n] != '\0');
+        }
+    } return dropped;
+}
+
+// A queued refresh is useless once its deadline passed, the cached entry
+// it refreshes was evicted, or a synchronous call refreshed it meanwhile.
+bool oauth_request_expired(OAuth* oauth, request_data* rq_data) {
+    if (rq_data->deadline && time_mono_ms() >= rq_data->deadline)
+        return true;
+
+    response_data cached;
+    return !cache_peek(&oauth->cache, rq_data->id, &cached) || cached.time > rq_data->enqueued;
+}
+
 void* oauth_process_request(void* data) {
     OAuth* oauth = (OAuth*) data;
     while (oauth->request_run) {
         while (oauth->request_queue.size == 0 && oauth->request_run);
         if (!oauth->request_run) break;
         mutex_lock(&oauth->request_mutex);
+        mutex_lock(&oauth->queue_mutex);
         request_data rq_data = oauth->request_queue.head->entry->value;
-        map_del_request(&oauth->request_queue, rq_data.id);
-        response_data response = request(rq_data.method, rq_data.endpoint, rq_data.header, rq_data.data);
+        map_del_request(&oauth->request_queue, oauth->request_queue.head->entry->key);
+        mutex_unlock(&oauth->queue_mutex);
+        uint64_t wait = (time_mono_ms() - rq_data.enqueued) * 1000;
+        char host[MAX_HOST];
+        host_of(rq_data.endpoint, host);
+        bool expired = oauth_request_expired(oauth, &rq_data);
+        if (expired || !oauth_breaker_allow(oauth, host)) {
+            oauth_count(oauth, expired ? QUEUE_SKIPPED : BREAKER_REJECTS, 1);
+            request_release(&rq_data);
+            mutex_unlock(&oauth->request_mutex);
+            continue;
+        }
+        void* ctx = TRACE_REQUEST_BEGIN(oauth, rq_data.method, rq_data.endpoint);
+        TRACE_BEGIN(oauth, ctx, STAGE_TRANSFER);
+        response_data response = request(oauth, rq_data.method, rq_data.endpoint, rq_data.header, rq_data.data);
+        TRACE_END(oauth, ctx, STAGE_TRANSFER);
+        response.timing[PHASE_QUEUE_WAIT] = wait;
+        oauth_record_timing(oauth, response.timing);
+        oauth_recorder_put(oauth, rq_data.method, rq_data.endpoint, OUTCOME_REFRESH, &response,
+                           (time_mono_ms() - rq_data.enqueued) * 1000);
+        oauth_breaker_record(oauth, host, response);
+        oauth_count_request(oauth, rq_data.method, response);
+        oauth_count(oauth, QUEUE_REFRESHES, 1);
+        oauth_record(oauth, LATENCY_QUEUE, (time_mono_ms() - rq_data.enqueued) * 1000);
         if (response.data && response.response_code == 200) {
-            map_put_response(&oauth->cache, rq_data.id, response);
+            TRACE_BEGIN(oauth, ctx, STAGE_CACHE_INSERT);
+            oauth_cache_put(oauth, rq_data.id, &response, false);
+            TRACE_END(oauth, ctx, STAGE_CACHE_INSERT);
         }  
+        TRACE_REQUEST_END(oauth, ctx, &response);
+        free((char*) response.data);
+        free((char*) response.content_type);
+        request_release(&rq_data);
         time_sleep(strtol(oauth->args[REQUEST_TIMEOUT], NULL, 10));
         mutex_unlock(&oauth->request_mutex);
     }
@@ -374,38 +1370,166 @@ void oauth_stop_request_thread(OAuth* oauth) {
     thread_term(&oauth->request_thread);
 }
 
+uint64_t oauth_queue_skipped(OAuth* oauth) {
+    return oauth_counter(oauth, QUEUE_SKIPPED);
+}
+
+void oauth_hedge_stats(OAuth* oauth, uint64_t* sent, uint64_t* won) {
+    if (sent) *sent = oauth_counter(oauth, HEDGES_SENT);
+    if (won) *won = oauth_counter(oauth, HEDGES_WON);
+}
+
+// Async callers record concurrently, each one claims its own slot
+void oauth_record_latency(OAuth* oauth, uint64_t ms) {
+    uint64_t slot = (uint64_t) atomic_add(&oauth->latency_count, 1);
+    atomic_set(&oauth->latency[slot % LATENCY_SAMPLES], ms);
+}
+
+int cmp_latency(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// The configured hedge_delay, otherwise the p95 of the last GETs. Zero
+// disables hedging until enough samples were observed.
+uint64_t oauth_hedge_delay(OAuth* oauth) {
+    if (oauth->hedge_delay) return oauth->hedge_delay;
+    if ((uint64_t) atomic_get(&oauth->latency_count) < LATENCY_SAMPLES) return 0;
+
+    uint64_t sorted[LATENCY_SAMPLES];
+    for (int i = 0; i < LATENCY_SAMPLES; i++)
+        sorted[i] = (uint64_t) atomic_get(&oauth->latency[i]);
+    qsort(sorted, LATENCY_SAMPLES, sizeof(uint64_t), cmp_latency);
+    return sorted[LATENCY_SAMPLES * 95 / 100] + 1;
+}
+
 response_data oauth_request(OAuth* oauth, REQUEST method, const char* endpoint) {
+    uint64_t begin = time_mono_ns(), lap;
+    uint64_t timing[NUM_PHASES] = {0};
     uint8_t options = oauth->current_options;
+    OUTCOME outcome = BIT(options, REQUEST_CACHE) ? OUTCOME_MISS : OUTCOME_BYPASS;
+    void* ctx = TRACE_REQUEST_BEGIN(oauth, method, endpoint);
+    TRACE_BEGIN(oauth, ctx, STAGE_BUILD);
     request_data rq_data;
     rq_data.id = NULL;
-    rq_data.data = parse_data(oauth->data, "&");
+    rq_data.data = NULL;
     rq_data.endpoint = endpoint;
     rq_data.header = oauth->header_slist;
     rq_data.method = method;
-    str_append_fmt(&rq_data.id, "/%s/%s", REQUEST_STRING[method], endpoint);
-    if (rq_data.data) str_append_fmt(&rq_data.id, "?%s", rq_data.data);
-
-    response_data response = map_get_response(&oauth->cache, rq_data.id);
+    rq_data.enqueued = time_mono_ms();
+    rq_data.deadline = oauth->current_deadline ? rq_data.enqueued + oauth->current_deadline : 0;
+    char host[MAX_HOST];
+    host_of(endpoint, host);
+    cache_key key = request_key(method, endpoint, oauth->data);
+    TRACE_END(oauth, ctx, STAGE_BUILD);
+
+    lap = time_mono_ns();
+    timing[PHASE_PARSE] = (lap - begin) / 1000;
+    TRACE_BEGIN(oauth, ctx, STAGE_CACHE_LOOKUP);
+    // a hit is only copied out when it is returned, an async request just
+    // needs to know it is cached
+    response_data response = {.data = 0}, cached;
+    bool hit = BIT(options, REQUEST_CACHE) &&
+               (BIT(options, REQUEST_ASYNC) ? cache_get_key(&oauth->cache, key, &cached)
+                                            : cache_get_copy(&oauth->cache, key, &response));
+    if (!hit && BIT(options, REQUEST_CACHE)) {
+        request_format(oauth->data, &rq_data);
+        if (spill_take(&oauth->spill, rq_data.id, &response)) {
+            oauth_count(oauth, SPILL_HITS, 1);
+            oauth_cache_put(oauth, rq_data.id, &response, false);
+        } else if (oauth->journal.base && snapshot_take(&oauth->snapshot, rq_data.id, &response)) {
+            // unchanged since the snapshot, nothing to journal
+            oauth_count(oauth, CACHE_FAULTS, 1);
+            cache_put_mapped(&oauth->cache, rq_data.id, response);
+            key_index_add(&oauth->keys, rq_data.id, NULL, 0);
+            // the mapping stays until oauth_delete, the caller still gets its own copy
+            response.data = strdup(response.data);
+            if (response.content_type) response.content_type = strdup(response.content_type);
+        }
+    }
+    TRACE_END(oauth, ctx, STAGE_CACHE_LOOKUP);
+    timing[PHASE_CACHE_LOOKUP] = (time_mono_ns() - lap) / 1000;
     if (BIT(options, REQUEST_CACHE) && !BIT(options, REQUEST_ASYNC) && (response.data)) {
-        if (!map_get_request(&oauth->request_queue, rq_data.id).id)
-            map_put_request(&oauth->request_queue, rq_data.id, rq_data);
-    } else  {
+        oauth_count(oauth, CACHE_HITS, 1);
+        outcome = OUTCOME_HIT;
+        TRACE_BEGIN(oauth, ctx, STAGE_ENQUEUE);
+        mutex_lock(&oauth->queue_mutex);
+        // a refresh already queued costs no formatting, the queue owns the
+        // strings of a new one
+        if (!map_get_request(&oauth->request_queue, key.lo).id) {
+            request_format(oauth->data, &rq_data);
+            map_put_request(&oauth->request_queue, key.lo, rq_data);
+            if (map_oom(&oauth->request_queue)) oauth_count(oauth, QUEUE_DROPS, 1);
+            else rq_data.id = rq_data.data = NULL;
+        } mutex_unlock(&oauth->queue_mutex);
+        TRACE_END(oauth, ctx, STAGE_ENQUEUE);
+    } else if (!oauth_breaker_allow(oauth, host)) {
+        // fail fast, a cached body is still better than nothing
+        oauth_count(oauth, BREAKER_REJECTS, 1);
+        if (!response.data && !cache_get_copy(&oauth->cache, key, &response))
+            response = (response_data) {.data = 0};
+        outcome = response.data ? OUTCOME_STALE : OUTCOME_REJECTED;
+        if (response.data) oauth_count(oauth, CACHE_STALE_HITS, 1);
+    } else {
+        if (BIT(options, REQUEST_CACHE)) oauth_count(oauth, CACHE_MISSES, 1);
+        // a fault the options did not let us use
+        free((char*) response.data);
+        free((char*) response.content_type);
+        request_format(oauth->data, &rq_data);
         if (oauth->authed && BIT(options, REQUEST_AUTH)) {
             const char* str = NULL;
             str_append_fmt(&str, "Authorization: %s %s", oauth->args[TOKEN_BEARER], oauth->args[ACCESS_TOKEN]);
             rq_data.header = curl_slist_append(rq_data.header, str);
         }
 
+        lap = time_mono_ns();
         if (!BIT(options, REQUEST_ASYNC)) mutex_lock(&oauth->request_mutex);
-        response = request(method, endpoint, rq_data.header, rq_data.data);
+        timing[PHASE_QUEUE_WAIT] = (time_mono_ns() - lap) / 1000;
+        uint64_t delay = (method == GET && BIT(options, REQUEST_HEDGE)) ? oauth_hedge_delay(oauth) : 0;
+        uint64_t start = time_mono_ms();
+        TRACE_BEGIN(oauth, ctx, STAGE_TRANSFER);
+        response = delay ? request_hedged(oauth, endpoint, rq_data.header, rq_data.data, delay)
+                         : request(oauth, method, endpoint, rq_data.header, rq_data.data);
+        TRACE_END(oauth, ctx, STAGE_TRANSFER);
+        for (int i = 0; i < PHASE_QUEUE_WAIT; i++)
+            timing[i] = response.timing[i];
+        timing[PHASE_PARSE] += response.timing[PHASE_PARSE];
+        oauth_breaker_record(oauth, host, response);
+        oauth_count_request(oauth, method, response);
+        if (response.data && method == GET)
+            oauth_record_latency(oauth, time_mono_ms() - start);
         if (response.data && BIT(options, REQUEST_CACHE) && response.response_code == 200) {
-            map_put_response(&oauth->cache, rq_data.id, response);
+            TRACE_BEGIN(oauth, ctx, STAGE_CACHE_INSERT);
+            oauth_cache_put(oauth, rq_data.id, &response, false);
+            TRACE_END(oauth, ctx, STAGE_CACHE_INSERT);
         } 
         if (!BIT(options, REQUEST_ASYNC)) mutex_unlock(&oauth->request_mutex);
+        if (method != GET && response.response_code >= 200 && response.response_code < 300)
+            oauth_invalidate_write(oauth, endpoint);
+    }
+
+    uint64_t latency = (time_mono_ns() - begin) / 1000;
+    oauth_record(oauth, BIT(options, REQUEST_ASYNC) ? LATENCY_ASYNC : LATENCY_SYNC, latency);
+    oauth_record_timing(oauth, timing);
+    memcpy(response.timing, timing, sizeof(timing));
+    if (outcome == OUTCOME_HIT || outcome == OUTCOME_STALE)
+        response.bytes_in = response.bytes_out = 0;
+    oauth_recorder_put(oauth, method, endpoint, outcome, &response, latency);
+    TRACE_REQUEST_END(oauth, ctx, &response);
+
+    // the tags go to the entry the response is cached under
+    if (oauth->tag_count && response.data &&
+        (outcome == OUTCOME_HIT || (outcome == OUTCOME_MISS && response.response_code == 200))) {
+        request_format(oauth->data, &rq_data);
+        if (!cache_oversized(&oauth->cache, rq_data.id, response))
+            key_index_add(&oauth->keys, rq_data.id, oauth->tags, oauth->tag_count);
     }
     
+    request_release(&rq_data);
+    oauth_clear_tags(oauth);
     sorted_map_free(oauth->data);
     oauth->current_options = oauth->default_options;
+    oauth->current_deadline = oauth->default_deadline;
     oauth->data = NULL;
     return response;
 }
@@ -419,6 +1543,11 @@ int oauth_process_ini(OAuth *oauth, int line, const char *section, const char *k
         return 0;
     }
 
+    if (!strcmp("Invalidation", section)) {
+        oauth_add_invalidation(oauth, key, value);
+        return 0;
+    }
+
     if (!strcmp("Params", section)) {
         for (i = 0; i < NUM_PARAMS; i++) {
             if (!strcmp(PARAM_STRING[i], key)) {
@@ -430,7 +1559,7 @@ int oauth_process_ini(OAuth *oauth, int line, const char *section, const char *k
 
     if (!strcmp("Options", section)) {
         uint8_t val = 1;
-        for (i = 0; i < 3; i++) {
+        for (i = 0; i < NUM_OPTIONS; i++) {
             if (!strcmp(OPTION_STRING[i], key) && !strcmp(value, "true")) {
                 oauth->default_options |= val;
                 oauth->current_options = oauth->default_options;
@@ -450,39 +1579,76 @@ bool oauth_load_config(OAuth* oauth) {
     return !ini_parse_file(oauth, oauth_process_ini, dir);
 }
 
-bool oauth_load_cache(OAuth* oauth) {
-    if (oauth->args[CACHE_FILE] == NULL) 
-        return NULL;
+void oauth_index_entry(void* arg, const char* key, response_data* value) {
+    key_index_add(&((OAuth*) arg)->keys, key, NULL, 0);
+}
 
-    FILE * fp;
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
+void oauth_index_record(void* arg, const char* key, const response_data* value) {
+    key_index_add(&((OAuth*) arg)->keys, key, NULL, 0);
+}
 
-    char* dir = getfullpath(oauth->args[CACHE_FILE]);
+void oauth_load_entry(void* arg, const char* key, const response_data* value) {
+    response_data response = *value;
+    oauth_cache_put((OAuth*) arg, key, &response, true);
+}
 
-    if (!(fp = fopen(dir, "r"))) {
+// The bodies stay in the mapped file, only the index is touched on startup.
+// A lazy load does not even insert the entries, a miss faults them in from
+// the mapping. The journal then replays the changes made since the snapshot
+// was written.
+bool oauth_load_cache(OAuth* oauth) {
+    if (oauth->args[CACHE_FILE] == NULL || oauth->journal.path)
         return NULL;
-    }
-
-    char* save = NULL;
-    while ((read = getline(&line, &len, fp)) != -1 && strcmp(line, "\n")) {
-        const char* key = strtok(line, " ");
-        const char* val = strtok(NULL, "");
-        response_data response;
-        response.content_type = strdup("unknown");
-        response.data = strdup(val);
-        response.response_code = 200;
-        map_put_response(&oauth->cache, strdup(key), response);
-    }
 
-    fclose(fp);
-    if (line) free(line);
-    return 1;    
+    bool lazy = oauth->args[CACHE_LAZY_LOAD] && !strcmp(oauth->args[CACHE_LAZY_LOAD], "true");
+    uint32_t threads = oauth->args[CACHE_LOAD_THREADS] ? strtoul(oauth->args[CACHE_LOAD_THREADS], NULL, 10) : 1;
+    uint64_t start = time_mono_ns();
+    char* dir = getfullpath(oauth->args[CACHE_FILE]);
+    if (!oauth->snapshot.base && snapshot_open(&oauth->snapshot, dir) && !lazy)
+        snapshot_foreach_parallel(&oauth->snapshot, threads, oauth_load_entry, oauth);
+
+    bool ok = journal_open(&oauth->journal, &oauth->cache, lazy ? &oauth->snapshot : NULL, dir,
+                           oauth->args[JOURNAL_RATIO] ? strtoull(oauth->args[JOURNAL_RATIO], NULL, 10) : JOURNAL_DEFAULT_RATIO);
+    str_destroy(&dir);
+    // the journal replay does not go through oauth_cache_put(), and the
+    // records a lazy load leaves in the mapping are indexed once here so an
+    // invalidation finds them without scanning the snapshot
+    cache_foreach(&oauth->cache, oauth_index_entry, oauth);
+    if (lazy) snapshot_foreach_live(&oauth->snapshot, oauth_index_record, oauth);
+    oauth->cache_load_us = (time_mono_ns() - start) / 1000;
+    return ok;
 }
 
 bool oauth_load(OAuth* oauth) {
     oauth_load_config(oauth);
+
+    if (oauth->args[SPILL_FILE] && !oauth->spill.path) {
+        char* path = getfullpath(oauth->args[SPILL_FILE]);
+        uint64_t max = oauth->args[SPILL_MAX_BYTES] ? strtoull(oauth->args[SPILL_MAX_BYTES], NULL, 10) : SPILL_DEFAULT_BYTES;
+        // the persistence thread writes the evicted entries
+        if (spill_open(&oauth->spill, path, max)) {
+            spill_set_drop(&oauth->spill, oauth_spill_drop, oauth);
+            oauth_persist(oauth, 0);
+        }
+        str_destroy(&path);
+    }
+
+    // sized before loading so the saved entries fit the configured cache
+    if (oauth->args[REQUEST_QUEUE_SIZE]) 
+        map_set_max_size(&oauth->request_queue, strtol(oauth->args[REQUEST_QUEUE_SIZE], NULL, 10));
+
+    if (oauth->args[CACHE_SIZE]) 
+        cache_set_max_size(&oauth->cache, strtol(oauth->args[CACHE_SIZE], NULL, 10));
+
+    if (oauth->args[CACHE_MAX_BYTES] || oauth->args[CACHE_MAX_ENTRY_BYTES])
+        cache_set_max_bytes(&oauth->cache,
+                            oauth->args[CACHE_MAX_BYTES] ? strtoull(oauth->args[CACHE_MAX_BYTES], NULL, 10) : 0,
+                            oauth->args[CACHE_MAX_ENTRY_BYTES] ? strtoull(oauth->args[CACHE_MAX_ENTRY_BYTES], NULL, 10) : 0);
+
+    for (int i = 0; oauth->args[CACHE_POLICY] && i < NUM_POLICIES; i++)
+        if (!strcmp(oauth->args[CACHE_POLICY], POLICY_STRING[i]))
+            cache_set_policy(&oauth->cache, i);
+
     oauth_load_cache(oauth);
 
     if (oauth->args[REFRESH_ON_LOAD])
@@ -491,11 +1657,20 @@ bool oauth_load(OAuth* oauth) {
     if (oauth->args[REQUEST_ON_LOAD])
         oauth_start_request_thread(oauth);
 
-    if (oauth->args[REQUEST_QUEUE_SIZE]) 
-        map_set_max_size(&oauth->request_queue, strtol(oauth->args[REQUEST_QUEUE_SIZE], NULL, 10));
+    if (oauth->args[HEDGE_DELAY])
+        oauth->hedge_delay = strtoull(oauth->args[HEDGE_DELAY], NULL, 10);
 
-    if (oauth->args[CACHE_SIZE]) 
-        map_set_max_size(&oauth->cache, strtol(oauth->args[CACHE_SIZE], NULL, 10));
+    if (oauth->args[BREAKER_THRESHOLD])
+        oauth->breaker_threshold = strtoul(oauth->args[BREAKER_THRESHOLD], NULL, 10);
+
+    if (oauth->args[BREAKER_FAILURE_RATE])
+        oauth->breaker_rate = strtoul(oauth->args[BREAKER_FAILURE_RATE], NULL, 10);
+
+    if (oauth->args[BREAKER_COOLDOWN])
+        oauth->breaker_cooldown = strtoull(oauth->args[BREAKER_COOLDOWN], NULL, 10);
+
+    if (oauth->args[REQUEST_DEADLINE])
+        oauth->default_deadline = oauth->current_deadline = strtoull(oauth->args[REQUEST_DEADLINE], NULL, 10);
 
     return oauth->authed;
 }
@@ -511,7 +1686,7 @@ bool oauth_save_config(OAuth* oauth) {
     ini_open(&aux, dir);
 
     // for every value in params save
-    for (uint32_t i = 0; i < 15; i++) {
+    for (uint32_t i = 0; i < NUM_PARAMS; i++) {
         ini_save(&aux, "Params", PARAM_STRING[i], oauth->args[i]);
     }
     
@@ -529,7 +1704,10 @@ bool oauth_save_config(OAuth* oauth) {
         ptr = ptr->next;
     }
 
-    ini_close(&aux);
+    for (uint32_t i = 0; i < oauth->rule_count; i++)
+        ini_save(&aux, "Invalidation", oauth->rules[i].pattern, oauth->rules[i].targets);
+
+    return ini_close(&aux);
 }
 
 bool oauth_save_cache(OAuth* oauth) {
@@ -537,26 +1715,44 @@ bool oauth_save_cache(OAuth* oauth) {
     if (oauth->args[CACHE_FILE] == NULL) 
         return NULL;
 
-    char* dir = getfullpath(oauth->args[CACHE_FILE]);
-
-    FILE *fp = fopen(dir, "w");
-    if (fp == NULL) return NULL;
-
-    struct map_link_response* link = oauth->cache.head;
-    if (link) {
-        fprintf(fp, "%s %s", link->entry->key, link->entry->value.data);
-    }
+    // with a journal every change is already on its way to disk
+    if (oauth->journal.path)
+        return journal_sync(&oauth->journal);
 
-    for (link = link->next; link; link = link->next) {
-        fprintf(fp, "\n%s %s", link->entry->key, link->entry->value.data);
-    }
-        
-    // close the file
-    fclose(fp);
-    return 1;
+    char* dir = getfullpath(oauth->args[CACHE_FILE]);
+    bool ok = snapshot_write(&oauth->cache, NULL, dir);
+    str_destroy(&dir);
+    return ok;
 }
 
 bool oauth_save(OAuth* oauth) {
+    TRACE_BEGIN(oauth, NULL, STAGE_PERSIST);
     oauth_save_config(oauth);
     oauth_save_cache(oauth);
+    TRACE_END(oauth, NULL, STAGE_PERSIST);
+}
+
+// Runs on the persistence thread, a journal only needs a sync and now and
+// then a compaction
+void oauth_persist_flush(void* arg, uint64_t dirty) {
+    OAuth* oauth = (OAuth*) arg;
+    TRACE_BEGIN(oauth, NULL, STAGE_PERSIST);
+    if (dirty & PERSIST_SPILL)
+        oauth_count(oauth, SPILL_WRITES, spill_flush(&oauth->spill));
+    if (dirty & PERSIST_CONFIG)
+        oauth_save_config(oauth);
+    if ((dirty & PERSIST_CACHE) && oauth->journal.path)
+        journal_maintain(&oauth->journal);
+    else if (dirty & PERSIST_CACHE)
+        oauth_save_cache(oauth);
+    TRACE_END(oauth, NULL, STAGE_PERSIST);
+}
+
+// Marks what changed, the persistence thread writes it within an interval
+void oauth_persist(OAuth* oauth, uint64_t what) {
+    persist_mark(&oauth->persist, what);
+    if (!atomic_get(&oauth->persist.run))
+        persist_start(&oauth->persist,
+                      oauth->args[PERSIST_INTERVAL] ? strtoull(oauth->args[PERSIST_INTERVAL], NULL, 10) : PERSIST_DEFAULT_MS,
+                      oauth_persist_flush, oauth);
 }
\ No newline at end of file
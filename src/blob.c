@@ -0,0 +1,82 @@
+#include "blob.h"
+
+map_def_scalar(blob, uint64_t, struct blob*, cmp_int, hash_64, 0)
+
+struct blob_shard* blob_shard_of(struct blob_store* s, const uint64_t hash[2]) {
+    return &s->shards[(hash[1] >> 32) % BLOB_SHARDS];
+}
+
+void blob_init(struct blob_store* s) {
+    for (int i = 0; i < BLOB_SHARDS; i++) {
+        map_init_blob(&s->shards[i].index, 0, 0);
+        map_set_max_size(&s->shards[i].index, UINT32_MAX);
+        mutex_init(&s->shards[i].mtx);
+    }
+    s->saved = 0;
+}
+
+void blob_term(struct blob_store* s) {
+    for (int i = 0; i < BLOB_SHARDS; i++) {
+        uint64_t hash; struct blob* b;
+        map_foreach(&s->shards[i].index, hash, b) free(b);
+        map_term_blob(&s->shards[i].index);
+        mutex_term(&s->shards[i].mtx);
+    }
+}
+
+struct blob* blob_intern(struct blob_store* s, const char* data, bool borrow) {
+    if (!data) return NULL;
+    size_t len = strlen(data);
+    uint64_t hash[2];
+    calc_murmur_128(hash, data, len);
+    struct blob_shard* shard = blob_shard_of(s, hash);
+
+    mutex_lock(&shard->mtx);
+    struct blob* b = map_get_blob(&shard->index, hash[0]);
+    if (b && b->hash[1] == hash[1] && b->len == len) {
+        b->refs++;
+        mutex_unlock(&shard->mtx);
+        return b;
+    }
+
+    bool indexed = b == NULL;
+    b = malloc(sizeof(struct blob) + (borrow ? 0 : len + 1));
+    *b = (struct blob) {
+        .hash = {hash[0], hash[1]}, .refs = 1, .live = 0, .len = (uint32_t) len,
+        .borrowed = borrow, .indexed = indexed, .data = borrow ? data : b->bytes
+    };
+    if (!borrow) memcpy(b->bytes, data, len + 1);
+    if (indexed) map_put_blob(&shard->index, hash[0], b);
+    mutex_unlock(&shard->mtx);
+    return b;
+}
+
+void blob_retain(struct blob_store* s, struct blob* b) {
+    if (!b) return;
+    struct blob_shard* shard = blob_shard_of(s, b->hash);
+    mutex_lock(&shard->mtx);
+    b->refs++;
+    mutex_unlock(&shard->mtx);
+}
+
+void blob_use(struct blob_store* s, struct blob* b, int users) {
+    if (!b) return;
+    uint64_t before = (uint64_t) atomic_add(&b->live, (uint64_t) (int64_t) users);
+    // every user past the first shares the bytes
+    if (users > 0 && before >= 1) atomic_add(&s->saved, b->len);
+    if (users < 0 && before > 1) atomic_add(&s->saved, -(uint64_t) b->len);
+}
+
+void blob_release(struct blob_store* s, struct blob* b) {
+    if (!b) return;
+    struct blob_shard* shard = blob_shard_of(s, b->hash);
+    mutex_lock(&shard->mtx);
+    bool last = --b->refs == 0;
+    if (last && b->indexed) map_del_blob(&shard->index, b->hash[0]);
+    mutex_unlock(&shard->mtx);
+    if (last) free(b);
+}
+
+uint64_t blob_saved(struct blob_store* s) {
+    return (uint64_t) atomic_get(&s->saved);
+}
@@ -0,0 +1,87 @@
+#ifndef OAUTH_BLOB_H
+#define OAUTH_BLOB_H
+
+#include <OAuth.h>
+
+#define BLOB_SHARDS 16
+
+// One distinct string, 'data' points at 'bytes' or at borrowed memory
+struct blob {
+    uint64_t hash[2];
+    uint64_t refs;
+    uint64_t live;               // cached entries using it, what 'saved' counts
+    uint32_t len;
+    bool borrowed;
+    bool indexed;                // false for the loser of a 64 bit collision
+    const char* data;
+    char bytes[];
+};
+
+map_dec_scalar(blob, uint64_t, struct blob*)
+
+struct blob_shard {
+    struct mutex mtx;
+    struct map_blob index;       // low half of the hash to blob
+    char pad[64];
+};
+
+/**
+ * Content addressed, reference counted string store. Equal strings are kept
+ * once and told apart by their 128 bit MurmurHash3 and length alone, a blob
+ * is freed with its last reference. Borrowed blobs point at memory that
+ * outlives the store instead of a copy. Every function is thread safe.
+ */
+struct blob_store {
+    struct blob_shard shards[BLOB_SHARDS];
+    uint64_t saved;              // bytes not held again thanks to sharing
+};
+
+/**
+ * @param s store
+ */
+void blob_init(struct blob_store* s);
+
+/**
+ * Frees every blob, no other thread may use 's' anymore.
+ * @param s store
+ */
+void blob_term(struct blob_store* s);
+
+/**
+ * Take a reference to the blob holding 'data', which is created from it
+ * when there is none yet.
+ * @param s      store
+ * @param data   string, may be NULL
+ * @param borrow point the new blob at 'data' instead of copying it
+ * @return       blob, NULL for a NULL string.
+ */
+struct blob* blob_intern(struct blob_store* s, const char* data, bool borrow);
+
+/**
+ * @param s store
+ * @param b blob, may be NULL
+ */
+void blob_retain(struct blob_store* s, struct blob* b);
+
+/**
+ * Count a user that can be reached, references still held by replaced or
+ * evicted copies waiting to be freed do not make a blob shared.
+ * @param s     store
+ * @param b     blob, may be NULL
+ * @param users +1 or -1
+ */
+void blob_use(struct blob_store* s, struct blob* b, int users);
+
+/**
+ * @param s store
+ * @param b blob, may be NULL
+ */
+void blob_release(struct blob_store* s, struct blob* b);
+
+/**
+ * @param s store
+ * @return  bytes sharing kept from being stored again
+ */
+uint64_t blob_saved(struct blob_store* s);
+
+#endif
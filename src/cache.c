@@ -0,0 +1,420 @@
+#include "cache.h"
+
+struct cache_shard* cache_shard_of(struct cache* c, uint32_t hash) {
+    return &c->shards[(hash >> 16) % CACHE_SHARDS];
+}
+
+// Power of two with at least one bucket per entry
+struct cache_table* cache_table_create(uint32_t capacity) {
+    uint32_t buckets = 16;
+    while (buckets < capacity) buckets *= 2;
+    struct cache_table* table = calloc(1, sizeof(struct cache_table) + buckets * sizeof(struct cache_entry*));
+    table->mask = buckets - 1;
+    return table;
+}
+
+uint32_t cache_charge(const char* key, response_data value) {
+    size_t bytes = sizeof(struct cache_entry) + strlen(key) + 1;
+    if (value.data) bytes += strlen(value.data) + 1;
+    if (value.content_type) bytes += strlen(value.content_type) + 1;
+    return bytes > UINT32_MAX ? UINT32_MAX : (uint32_t) bytes;
+}
+
+cache_key cache_key_of(const char* key) {
+    uint64_t hash[2];
+    calc_murmur_128(hash, key, strlen(key));
+    return (cache_key) {.lo = hash[0], .hi = hash[1]};
+}
+
+struct cache_entry* cache_entry_create(struct cache* c, const char* key, cache_key id, response_data value, bool mapped) {
+    size_t len = strlen(key) + 1;
+    struct cache_entry* entry = malloc(sizeof(struct cache_entry) + len);
+    *entry = (struct cache_entry) {.id = id, .hash = (uint32_t) id.lo, .charge = cache_charge(key, value), .value = value};
+    entry->body = blob_intern(&c->blobs, value.data, mapped);
+    entry->type = blob_intern(&c->blobs, value.content_type, mapped);
+    entry->value.data = entry->body ? entry->body->data : NULL;
+    entry->value.content_type = entry->type ? entry->type->data : NULL;
+    memcpy(entry->key, key, len);
+    return entry;
+}
+
+// Same entry sharing the blobs of 'entry'
+struct cache_entry* cache_entry_copy(struct cache_shard* shard, struct cache_entry* entry) {
+    size_t size = sizeof(struct cache_entry) + strlen(entry->key) + 1;
+    struct cache_entry* copy = malloc(size);
+    memcpy(copy, entry, size);
+    copy->next = copy->retired = copy->newer = copy->older = NULL;
+    copy->referenced = atomic_get(&entry->referenced);
+    blob_retain(shard->blobs, copy->body);
+    blob_retain(shard->blobs, copy->type);
+    return copy;
+}
+
+// Tells the blob store whether the entry is reachable from the table
+void cache_entry_use(struct cache_shard* shard, struct cache_entry* entry, int users) {
+    blob_use(shard->blobs, entry->body, users);
+    blob_use(shard->blobs, entry->type, users);
+}
+
+void cache_entry_free(struct cache_shard* shard, struct cache_entry* entry) {
+    blob_release(shard->blobs, entry->body);
+    blob_release(shard->blobs, entry->type);
+    free(entry);
+}
+
+struct cache_entry* cache_find(struct cache_table* table, cache_key id) {
+    struct cache_entry* entry = (struct cache_entry*) atomic_get(&table->buckets[(uint32_t) id.lo & table->mask]);
+    for (; entry; entry = (struct cache_entry*) atomic_get(&entry->next))
+        if (entry->id.lo == id.lo && entry->id.hi == id.hi) return entry;
+    return NULL;
+}
+
+// Frees what the oldest running reader can not see anymore, the limbo lists
+// are sorted newest first so everything past the first safe node goes too
+void cache_reclaim(struct cache_shard* shard) {
+    struct cache_entry** entry = &shard->limbo;
+    while (*entry && !epoch_safe((*entry)->epoch)) entry = &(*entry)->retired;
+    while (*entry) {
+        struct cache_entry* next = (*entry)->retired;
+        cache_entry_free(shard, *entry);
+        *entry = next;
+        shard->limbo_size--;
+    }
+
+    struct cache_table** table = &shard->limbo_tables;
+    while (*table && !epoch_safe((*table)->epoch)) table = &(*table)->retired;
+    while (*table) {
+        struct cache_table* next = (*table)->retired;
+        free(*table);
+        *table = next;
+    }
+}
+
+// Waits until every reader that started before the call has left
+void cache_synchronize() {
+    atomic_fence();
+    uint64_t tag = epoch_now();
+    for (int spins = 0; !epoch_safe(tag); spins++)
+        if (spins > 16) time_sleep(1);
+}
+
+void cache_retire(struct cache_shard* shard, struct cache_entry* entry) {
+    atomic_fence(); // the unlink has to be visible before the epoch is read
+    entry->epoch = epoch_now();
+    entry->retired = shard->limbo;
+    shard->limbo = entry;
+    if (++shard->limbo_size >= CACHE_LIMBO) cache_reclaim(shard);
+}
+
+void cache_unlink(struct cache_shard* shard, struct cache_entry* entry) {
+    struct cache_entry** link = &shard->table->buckets[entry->hash & shard->table->mask];
+    while (*link != entry) link = &(*link)->next;
+    atomic_set(link, entry->next);
+    shard->size--;
+    shard->bytes -= entry->charge;
+    cache_entry_use(shard, entry, -1);
+    cache_retire(shard, entry);
+}
+
+bool cache_over(struct cache_shard* shard) {
+    return shard->size > shard->capacity || (shard->max_bytes && shard->bytes > shard->max_bytes);
+}
+
+uint32_t cache_shrink(struct cache* c, struct cache_shard* shard) {
+    struct cache_entry* entry;
+    uint32_t evicted = 0;
+    while (cache_over(shard) && (entry = shard->policy->evict(shard->state))) {
+        if (c->on_evict) c->on_evict(c->evict_arg, entry->key, &entry->value);
+        cache_unlink(shard, entry);
+        evicted++;
+    } return evicted;
+}
+
+// Rebuilds the policy state, and the table when its size changes, with the
+// shard lock held. Readers may still run access() on the old state, so it is
+// unpublished and waited out before it is destroyed. Entries are re-linked
+// into fresh copies so readers walking the old table never see a chain change.
+void cache_rebuild(struct cache* c, struct cache_shard* shard, const struct cache_policy* policy, uint32_t capacity) {
+    void* old_state = shard->state;
+    if (old_state) {
+        atomic_set(&shard->state, NULL);
+        cache_synchronize();
+        shard->policy->destroy(old_state);
+    }
+
+    // the policy state is complete before it is published
+    struct cache_entry** entries = malloc((shard->size + 1) * sizeof(struct cache_entry*));
+    uint32_t size = 0;
+    for (uint32_t i = 0; i <= shard->table->mask; i++)
+        for (struct cache_entry* entry = shard->table->buckets[i]; entry; entry = entry->next)
+            entries[size++] = entry;
+
+    void* state = policy->create(capacity);
+    shard->policy = policy;
+    shard->capacity = capacity;
+    shard->size = 0;
+    shard->bytes = 0;
+    atomic_set(&shard->state, state);
+    for (uint32_t i = 0; i < size; i++) {
+        policy->insert(state, entries[i]);
+        shard->size++;
+        shard->bytes += entries[i]->charge;
+        cache_shrink(c, shard);
+    }
+    free(entries);
+
+    struct cache_table* old = shard->table;
+    struct cache_table* table = cache_table_create(capacity);
+    if (table->mask == old->mask) {
+        free(table);
+    } else {
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            for (struct cache_entry* entry = old->buckets[i]; entry; entry = entry->next) {
+                struct cache_entry* copy = cache_entry_copy(shard, entry);
+                copy->next = table->buckets[copy->hash & table->mask];
+                table->buckets[copy->hash & table->mask] = copy;
+                policy->replace(state, entry, copy);
+            }
+        }
+
+        // readers only stop reaching the old entries once the table is swapped
+        atomic_set(&shard->table, table);
+        for (uint32_t i = 0; i <= old->mask; i++) {
+            for (struct cache_entry* entry = old->buckets[i], *next; entry; entry = next) {
+                next = entry->next;
+                cache_retire(shard, entry);
+            }
+        }
+        old->epoch = epoch_now();
+        old->retired = shard->limbo_tables;
+        shard->limbo_tables = old;
+    }
+}
+
+void cache_init(struct cache* c, uint32_t max_size, POLICY policy) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        c->shards[i] = (struct cache_shard) {.table = cache_table_create(0), .blobs = &c->blobs};
+        mutex_init(&c->shards[i].mtx);
+    }
+    blob_init(&c->blobs);
+    c->policy = policy;
+    c->on_evict = NULL;
+    c->max_bytes = c->max_entry = 0;
+    cache_set_max_size(c, max_size);
+}
+
+void cache_set_evict(struct cache* c, void (*fn)(void* arg, const char* key, const response_data* value), void* arg) {
+    c->evict_arg = arg;
+    c->on_evict = fn;
+}
+
+void cache_term(struct cache* c) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard* shard = &c->shards[i];
+        for (uint32_t j = 0; j <= shard->table->mask; j++) {
+            for (struct cache_entry* entry = shard->table->buckets[j], *next; entry; entry = next) {
+                next = entry->next;
+                cache_entry_free(shard, entry);
+            }
+        }
+        for (struct cache_entry* entry = shard->limbo, *next; entry; entry = next) {
+            next = entry->retired;
+            cache_entry_free(shard, entry);
+        }
+        for (struct cache_table* table = shard->limbo_tables, *next; table; table = next) {
+            next = table->retired;
+            free(table);
+        }
+        shard->policy->destroy(shard->state);
+        free(shard->table);
+        mutex_term(&shard->mtx);
+    }
+    blob_term(&c->blobs);
+}
+
+void cache_set_max_size(struct cache* c, uint32_t max_size) {
+    uint32_t capacity = (max_size + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if (capacity == 0) capacity = 1;
+    c->max_size = max_size;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        mutex_lock(&c->shards[i].mtx);
+        cache_rebuild(c, &c->shards[i], CACHE_POLICIES[c->policy], capacity);
+        mutex_unlock(&c->shards[i].mtx);
+    }
+}
+
+void cache_set_max_bytes(struct cache* c, uint64_t max_bytes, uint64_t max_entry) {
+    c->max_bytes = max_bytes;
+    c->max_entry = max_entry;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        mutex_lock(&c->shards[i].mtx);
+        c->shards[i].max_bytes = (max_bytes + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        cache_shrink(c, &c->shards[i]);
+        mutex_unlock(&c->shards[i].mtx);
+    }
+}
+
+bool cache_oversized(struct cache* c, const char* key, response_data value) {
+    uint32_t charge = cache_charge(key, value);
+    return (c->max_entry && charge > c->max_entry) ||
+           (c->max_bytes && charge > (c->max_bytes + CACHE_SHARDS - 1) / CACHE_SHARDS);
+}
+
+void cache_set_policy(struct cache* c, POLICY policy) {
+    c->policy = policy;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        mutex_lock(&c->shards[i].mtx);
+        cache_rebuild(c, &c->shards[i], CACHE_POLICIES[policy], c->shards[i].capacity);
+        mutex_unlock(&c->shards[i].mtx);
+    }
+}
+
+bool cache_lookup(struct cache* c, cache_key key, response_data* value, bool mark, bool copy) {
+    struct cache_shard* shard = cache_shard_of(c, (uint32_t) key.lo);
+
+    // out of epoch slots, the lock keeps writers from freeing under us
+    bool locked = !epoch_enter();
+    if (locked) mutex_lock(&shard->mtx);
+
+    struct cache_entry* entry = cache_find((struct cache_table*) atomic_get(&shard->table), key);
+    if (entry) {
+        *value = entry->value;
+        // copied before leaving, a writer may free the blobs right after
+        if (copy && value->data) value->data = strdup(value->data);
+        if (copy && value->content_type) value->content_type = strdup(value->content_type);
+        // reading first keeps the line shared on the hot path
+        if (mark && !atomic_get(&entry->referenced)) atomic_set(&entry->referenced, 1);
+        void* state = (void*) atomic_get(&shard->state);
+        if (mark && state && shard->policy->access) shard->policy->access(state, entry);
+    }
+
+    if (locked) mutex_unlock(&shard->mtx);
+    else epoch_exit();
+    return entry != NULL;
+}
+
+bool cache_get(struct cache* c, const char* key, response_data* value) {
+    return cache_lookup(c, cache_key_of(key), value, true, false);
+}
+
+bool cache_peek(struct cache* c, const char* key, response_data* value) {
+    return cache_lookup(c, cache_key_of(key), value, false, false);
+}
+
+bool cache_get_key(struct cache* c, cache_key key, response_data* value) {
+    return cache_lookup(c, key, value, true, false);
+}
+
+bool cache_get_copy(struct cache* c, cache_key key, response_data* value) {
+    return cache_lookup(c, key, value, true, true);
+}
+
+uint32_t cache_insert(struct cache* c, const char* key, response_data value, bool mapped) {
+    if (cache_oversized(c, key, value)) {
+        cache_del(c, key);
+        return 0;
+    }
+
+    cache_key id = cache_key_of(key);
+    struct cache_shard* shard = cache_shard_of(c, (uint32_t) id.lo);
+    struct cache_entry* entry = cache_entry_create(c, key, id, value, mapped);
+    uint32_t evicted = 0;
+
+    mutex_lock(&shard->mtx);
+    struct cache_table* table = shard->table;
+    struct cache_entry* old = cache_find(table, id);
+    struct cache_entry** link = &table->buckets[entry->hash & table->mask];
+
+    if (old) {
+        // swapped in place, readers on 'old' still reach the rest of the chain
+        while (*link != old) link = &(*link)->next;
+        entry->next = old->next;
+        entry->referenced = atomic_get(&old->referenced);
+        shard->policy->replace(shard->state, old, entry);
+        atomic_set(link, entry);
+        shard->bytes += entry->charge - old->charge;
+        cache_entry_use(shard, entry, 1);
+        cache_entry_use(shard, old, -1);
+        cache_retire(shard, old);
+    } else {
+        entry->next = *link;
+        shard->policy->insert(shard->state, entry);
+        atomic_set(link, entry);
+        shard->size++;
+        shard->bytes += entry->charge;
+        cache_entry_use(shard, entry, 1);
+    }
+
+    // a bigger body can push the shard over its budget on a replace too
+    evicted = cache_shrink(c, shard);
+    mutex_unlock(&shard->mtx);
+    return evicted;
+}
+
+uint32_t cache_put(struct cache* c, const char* key, response_data value) {
+    return cache_insert(c, key, value, false);
+}
+
+uint32_t cache_put_mapped(struct cache* c, const char* key, response_data value) {
+    return cache_insert(c, key, value, true);
+}
+
+bool cache_del(struct cache* c, const char* key) {
+    cache_key id = cache_key_of(key);
+    struct cache_shard* shard = cache_shard_of(c, (uint32_t) id.lo);
+
+    mutex_lock(&shard->mtx);
+    struct cache_entry* entry = cache_find(shard->table, id);
+    if (entry) {
+        shard->policy->remove(shard->state, entry);
+        cache_unlink(shard, entry);
+    }
+    mutex_unlock(&shard->mtx);
+    return entry != NULL;
+}
+
+uint32_t cache_size(struct cache* c) {
+    uint32_t size = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        mutex_lock(&c->shards[i].mtx);
+        size += c->shards[i].size;
+        mutex_unlock(&c->shards[i].mtx);
+    } return size;
+}
+
+uint64_t cache_bytes(struct cache* c) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        mutex_lock(&c->shards[i].mtx);
+        bytes += c->shards[i].bytes;
+        mutex_unlock(&c->shards[i].mtx);
+    } return bytes;
+}
+
+uint64_t cache_saved(struct cache* c) {
+    return blob_saved(&c->blobs);
+}
+
+void cache_foreach(struct cache* c, void (*fn)(void* arg, const char* key, response_data* value), void* arg) {
+    struct cache_entry** copies = NULL;
+    uint32_t cap = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard* shard = &c->shards[i];
+        uint32_t count = 0;
+        mutex_lock(&shard->mtx);
+        struct cache_table* table = shard->table;
+        for (uint32_t j = 0; j <= table->mask; j++)
+            for (struct cache_entry* entry = table->buckets[j]; entry; entry = entry->next) {
+                if (count == cap)
+                    copies = realloc(copies, (cap = cap ? cap * 2 : 64) * sizeof(struct cache_entry*));
+                copies[count++] = cache_entry_copy(shard, entry);
+            }
+        mutex_unlock(&shard->mtx);
+
+        for (uint32_t j = 0; j < count; j++) {
+            fn(arg, copies[j]->key, &copies[j]->value);
+            cache_entry_free(shard, copies[j]);
+        }
+    } free(copies);
+}
@@ -0,0 +1,259 @@
+#ifndef OAUTH_CACHE_H
+#define OAUTH_CACHE_H
+
+#include <OAuth.h>
+#include "blob.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_LIMBO 64
+
+/**
+ * Fixed size key, the 128 bit hash of the formatted key. Entries are told
+ * apart by it alone, so a lookup compares 16 bytes instead of the string and
+ * oauth_request() can compute it from the request's parts without formatting
+ * or allocating anything.
+ */
+typedef struct cache_key {
+    uint64_t lo;
+    uint64_t hi;
+} cache_key;
+
+/**
+ * Response cache split in CACHE_SHARDS shards, a key always lives in the shard
+ * picked by the top bits of its hash. Every function is thread safe.
+ *
+ * Lookups take no lock: they walk the bucket chains inside an epoch (see
+ * utils/epoch.h), set the entry's referenced bit only when it is clear and
+ * tell the eviction policy through its lock free access() hook. Writers
+ * serialize on the shard mutex, never modify a published entry but swap in a
+ * new one, and let the policy pick victims. Replaced and evicted entries are
+ * freed once no reader can hold them anymore.
+ *
+ * Bodies and content types live in a content addressed blob store, an entry
+ * holds a reference to each, so identical bodies cached under several keys
+ * are stored once.
+ */
+struct cache_entry {
+    struct cache_entry* next;    // bucket chain
+    struct cache_entry* retired; // limbo list
+    uint64_t epoch;              // epoch_now() when unlinked
+    uint64_t referenced;         // set by readers, cleared by the policy
+    cache_key id;
+    uint32_t hash;               // low bits of 'id'
+    uint32_t charge;             // bytes accounted against the budget
+    // owned by the policy, only touched under the shard lock
+    struct cache_entry* newer;
+    struct cache_entry* older;
+    uint32_t slot;
+    uint8_t queue;
+    struct blob* body;
+    struct blob* type;
+    response_data value;         // points into 'body' and 'type'
+    char key[];
+};
+
+/**
+ * Eviction policy of one shard. Every hook but access() runs under the shard
+ * lock, the shard evicts while it holds more than its capacity.
+ */
+struct cache_policy {
+    void* (*create)(uint32_t capacity);
+    void (*destroy)(void* state);
+    void (*resize)(void* state, uint32_t capacity);
+    // a reader hit 'entry', lock free and may run concurrently with anything
+    void (*access)(void* state, struct cache_entry* entry);
+    void (*insert)(void* state, struct cache_entry* entry);
+    // 'entry' takes over the place of 'old'
+    void (*replace)(void* state, struct cache_entry* old, struct cache_entry* entry);
+    void (*remove)(void* state, struct cache_entry* entry);
+    // detaches and returns the entry to evict, NULL when empty
+    struct cache_entry* (*evict)(void* state);
+};
+
+extern const struct cache_policy* CACHE_POLICIES[NUM_POLICIES];
+
+struct cache_table {
+    struct cache_table* retired;
+    uint64_t epoch;
+    uint32_t mask;
+    struct cache_entry* buckets[];
+};
+
+struct cache_shard {
+    struct mutex mtx;            // writers only
+    struct cache_table* table;   // replaced when the capacity changes
+    const struct cache_policy* policy;
+    void* state;                 // policy state, replaced with the policy
+    uint32_t capacity;
+    uint32_t size;
+    uint64_t max_bytes;          // zero for no budget
+    uint64_t bytes;
+    uint32_t limbo_size;
+    struct cache_entry* limbo;   // newest first
+    struct cache_table* limbo_tables;
+    struct blob_store* blobs;
+    char pad[64]; // keeps neighbouring shards off each other's cache lines
+};
+
+struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+    uint32_t max_size;
+    uint64_t max_bytes;
+    uint64_t max_entry;
+    POLICY policy;
+    void (*on_evict)(void* arg, const char* key, const response_data* value);
+    void* evict_arg;
+    struct blob_store blobs;
+};
+
+/**
+ * @param key key
+ * @return    its fixed size key
+ */
+cache_key cache_key_of(const char* key);
+
+/**
+ * @param c        cache
+ * @param max_size maximum entry count over all shards
+ * @param policy   eviction policy
+ */
+void cache_init(struct cache* c, uint32_t max_size, POLICY policy);
+
+/**
+ * Frees every entry, no other thread may use 'c' anymore.
+ * @param c cache
+ */
+void cache_term(struct cache* c);
+
+/**
+ * Every shard holds up to max_size / CACHE_SHARDS entries (rounded up).
+ * @param c        cache
+ * @param max_size maximum entry count over all shards
+ */
+void cache_set_max_size(struct cache* c, uint32_t max_size);
+
+/**
+ * Bound the cache by memory as well. An entry is charged for its key, body,
+ * content type and bookkeeping, every shard evicts until it is back under
+ * max_bytes / CACHE_SHARDS (rounded up). Entries charged more than 'max_entry'
+ * or a shard's budget are not cached, the ones already cached stay.
+ * @param c         cache
+ * @param max_bytes byte budget over all shards, zero for none
+ * @param max_entry largest entry in bytes, zero for no limit
+ */
+void cache_set_max_bytes(struct cache* c, uint64_t max_bytes, uint64_t max_entry);
+
+/**
+ * @param key   key
+ * @param value value
+ * @return      bytes the entry would be charged
+ */
+uint32_t cache_charge(const char* key, response_data value);
+
+/**
+ * @param c     cache
+ * @param key   key
+ * @param value value
+ * @return      'true' if cache_put() would refuse the entry for its size.
+ */
+bool cache_oversized(struct cache* c, const char* key, response_data value);
+
+/**
+ * Called for every entry the policy evicts, with the shard lock held. Not
+ * called for replaced or deleted entries.
+ * @param c   cache
+ * @param fn  callback, NULL for none
+ * @param arg passed to 'fn'
+ */
+void cache_set_evict(struct cache* c, void (*fn)(void* arg, const char* key, const response_data* value), void* arg);
+
+/**
+ * Switch the eviction policy, the cached entries are kept up to the new
+ * policy's admission.
+ * @param c      cache
+ * @param policy eviction policy
+ */
+void cache_set_policy(struct cache* c, POLICY policy);
+
+/**
+ * Look a key up and mark it as recently used.
+ * @param c     cache
+ * @param key   key
+ * @param value set to the cached value when found, it points into the cache
+ *              and may be freed once the entry is replaced or evicted
+ * @return      'true' if the key is cached.
+ */
+bool cache_get(struct cache* c, const char* key, response_data* value);
+
+/**
+ * Same as cache_get() without marking the entry.
+ */
+bool cache_peek(struct cache* c, const char* key, response_data* value);
+
+/**
+ * Same as cache_get() with a key cache_key_of() computed already.
+ */
+bool cache_get_key(struct cache* c, cache_key key, response_data* value);
+
+/**
+ * Same as cache_get_key() with the body and content type copied before the
+ * entry can be freed, the copies are owned by the caller.
+ */
+bool cache_get_copy(struct cache* c, cache_key key, response_data* value);
+
+/**
+ * Insert or replace. The cache keeps a copy of 'key', and of the body and
+ * content type unless an identical one is cached already, the memory 'value'
+ * points to stays owned by the caller. A cached body is only valid until its
+ * last entry is freed. An oversized entry is not cached and drops the copy
+ * cached under 'key', if any.
+ * @param c     cache
+ * @param key   key
+ * @param value value
+ * @return      number of entries evicted to make room, possibly including
+ *              the new one when the policy rejected it.
+ */
+uint32_t cache_put(struct cache* c, const char* key, response_data value);
+
+/**
+ * Same as cache_put() for a body and content type that outlive the cache,
+ * like a mapped snapshot's. They are shared without being copied.
+ */
+uint32_t cache_put_mapped(struct cache* c, const char* key, response_data value);
+
+/**
+ * @param c   cache
+ * @param key key
+ * @return    'true' if the key was cached.
+ */
+bool cache_del(struct cache* c, const char* key);
+
+/**
+ * @param c cache
+ * @return  entry count over all shards
+ */
+uint32_t cache_size(struct cache* c);
+
+/**
+ * @param c cache
+ * @return  bytes charged over all shards
+ */
+uint64_t cache_bytes(struct cache* c);
+
+/**
+ * @param c cache
+ * @return  body and content type bytes not stored twice
+ */
+uint64_t cache_saved(struct cache* c);
+
+/**
+ * Visit every entry, in no particular order. Each shard is copied out under
+ * its lock, the copies share the blobs, so the callback runs unlocked and may
+ * be slow or call back into 'c'. Entries changed meanwhile may be missed.
+ * @param c   cache
+ * @param fn  callback
+ * @param arg passed to 'fn'
+ */
+void cache_foreach(struct cache* c, void (*fn)(void* arg, const char* key, response_data* value), void* arg);
+
+#endif
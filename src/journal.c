@@ -0,0 +1,204 @@
+#include "journal.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#define journal_fsync(fp) _commit(_fileno(fp))
+#else
+#include <unistd.h>
+#define journal_fsync(fp) fsync(fileno(fp))
+#endif
+
+// Applies a journal to the cache, stops at the first torn record
+bool journal_replay(struct journal* j, const char* path, bool* found) {
+    FILE* fp = fopen(path, "rb");
+    journal_record rec;
+    uint64_t good = 0;
+    bool ok = true;
+
+    *found = fp != NULL;
+    if (!fp) return true;
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        char* key = malloc(rec.key_len + 1);
+        char* data = rec.op == JOURNAL_PUT ? malloc(rec.data_len + 1) : NULL;
+        char* type = rec.op == JOURNAL_PUT ? malloc(rec.type_len + 1) : NULL;
+        ok = rec.op <= JOURNAL_DEL && fread(key, 1, rec.key_len, fp) == rec.key_len &&
+             (rec.op == JOURNAL_DEL || (fread(data, 1, rec.data_len, fp) == rec.data_len &&
+                                        fread(type, 1, rec.type_len, fp) == rec.type_len));
+        if (!ok) {
+            free(key);
+            free(data);
+            free(type);
+            break;
+        }
+
+        key[rec.key_len] = '\0';
+        if (j->base) snapshot_consume(j->base, key);
+        if (rec.op == JOURNAL_DEL) cache_del(j->cache, key);
+        else {
+            data[rec.data_len] = type[rec.type_len] = '\0';
+            cache_put(j->cache, key, (response_data) {.data = data, .content_type = type,
+                                                      .response_code = (long) rec.response_code, .time = rec.time});
+        }
+        good += sizeof(rec) + rec.key_len + rec.data_len + rec.type_len;
+        free(key);
+        free(data);
+        free(type);
+    }
+
+    // a short header reads nothing but still moves the position
+    ok = ok && feof(fp) && (uint64_t) ftell(fp) == good;
+    j->bytes += good;
+    fclose(fp);
+    return ok;
+}
+
+// Writes out the records buffered so far, 'io' held. The buffer is swapped
+// out so writers keep appending meanwhile.
+void journal_drain(struct journal* j) {
+    mutex_lock(&j->mtx);
+    char* buf = j->buf;
+    size_t len = j->len;
+    j->buf = NULL;
+    j->len = j->cap = 0;
+    mutex_unlock(&j->mtx);
+
+    if (j->fp && len) fwrite(buf, 1, len, j->fp);
+    free(buf);
+}
+
+// Moves the journal aside and snapshots the cache, the records written
+// meanwhile go to a fresh journal
+bool journal_compact(struct journal* j) {
+    FILE* probe = fopen(j->old, "rb");
+    bool ok = true;
+
+    // a failed snapshot left the old journal behind, just retry it
+    mutex_lock(&j->io);
+    if (probe) fclose(probe);
+    else {
+        journal_drain(j);
+        if (j->fp) {
+            fflush(j->fp);
+            journal_fsync(j->fp);
+            fclose(j->fp);
+        }
+        rename(j->log, j->old);
+        ok = (j->fp = fopen(j->log, "ab")) != NULL;
+        // what was buffered since the drain goes to the fresh journal
+        mutex_lock(&j->mtx);
+        j->bytes = j->len;
+        mutex_unlock(&j->mtx);
+    }
+    mutex_unlock(&j->io);
+
+    if (ok && (ok = snapshot_write(j->cache, j->base, j->path))) {
+        remove(j->old);
+        j->compactions++;
+    } return ok;
+}
+
+bool journal_open(struct journal* j, struct cache* c, struct snapshot* base, const char* path, uint64_t ratio) {
+    bool found_old, found_log;
+    *j = (struct journal) {
+        .cache = c, .base = base, .ratio = ratio,
+        .path = str_create(path),
+        .log = str_create_fmt("%s.journal", path),
+        .old = str_create_fmt("%s.journal.old", path)
+    };
+    mutex_init(&j->mtx);
+    mutex_init(&j->io);
+
+    // an old journal means the last compaction never finished, a torn record
+    // a crash mid write. Both are folded into a snapshot before appending.
+    bool clean = journal_replay(j, j->old, &found_old);
+    clean = journal_replay(j, j->log, &found_log) && clean;
+    if (found_old || !clean) {
+        if (!snapshot_write(c, base, path)) {
+            journal_close(j);
+            return false;
+        }
+        remove(j->old);
+        remove(j->log);
+        j->bytes = 0;
+    }
+
+    j->fp = fopen(j->log, "ab");
+    if (!j->fp) journal_close(j);
+    return j->fp != NULL;
+}
+
+void journal_close(struct journal* j) {
+    if (!j->path) return;
+    journal_drain(j);
+    if (j->fp) {
+        fflush(j->fp);
+        journal_fsync(j->fp);
+        fclose(j->fp);
+    }
+    mutex_term(&j->mtx);
+    mutex_term(&j->io);
+    str_destroy(&j->path);
+    str_destroy(&j->log);
+    str_destroy(&j->old);
+    j->fp = NULL;
+}
+
+void journal_write(struct journal* j, journal_record* rec, const char* key, const response_data* value) {
+    if (!j->path) return;
+    if (j->base) snapshot_consume(j->base, key);
+    size_t length = sizeof(*rec) + rec->key_len + rec->data_len + rec->type_len;
+
+    mutex_lock(&j->mtx);
+    if (j->len + length > j->cap) {
+        j->cap = j->len + length > 2 * j->cap ? j->len + length : 2 * j->cap;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    char* w = j->buf + j->len;
+    memcpy(w, rec, sizeof(*rec));
+    memcpy(w += sizeof(*rec), key, rec->key_len);
+    if (value) {
+        memcpy(w += rec->key_len, value->data, rec->data_len);
+        memcpy(w + rec->data_len, value->content_type, rec->type_len);
+    }
+    j->len += length;
+    j->bytes += length;
+    mutex_unlock(&j->mtx);
+}
+
+void journal_put(struct journal* j, const char* key, const response_data* value) {
+    if (!value->data) return;
+    journal_record rec = {
+        .op = JOURNAL_PUT,
+        .key_len = strlen(key),
+        .data_len = strlen(value->data),
+        .type_len = value->content_type ? strlen(value->content_type) : 0,
+        .response_code = value->response_code,
+        .time = value->time
+    };
+    response_data v = *value;
+    if (!v.content_type) v.content_type = "";
+    journal_write(j, &rec, key, &v);
+}
+
+void journal_del(struct journal* j, const char* key) {
+    journal_record rec = {.op = JOURNAL_DEL, .key_len = strlen(key)};
+    journal_write(j, &rec, key, NULL);
+}
+
+bool journal_sync(struct journal* j) {
+    if (!j->path) return false;
+    mutex_lock(&j->io);
+    journal_drain(j);
+    bool ok = j->fp && !fflush(j->fp) && !journal_fsync(j->fp);
+    mutex_unlock(&j->io);
+    return ok;
+}
+
+bool journal_maintain(struct journal* j) {
+    if (!journal_sync(j)) return false;
+    mutex_lock(&j->mtx);
+    bool due = j->bytes > JOURNAL_MIN_BYTES && j->bytes > j->ratio * cache_bytes(j->cache);
+    mutex_unlock(&j->mtx);
+    return !due || journal_compact(j);
+}
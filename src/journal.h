@@ -0,0 +1,106 @@
+#ifndef OAUTH_JOURNAL_H
+#define OAUTH_JOURNAL_H
+
+#include <OAuth.h>
+#include <stdio.h>
+#include "cache.h"
+#include "snapshot.h"
+
+#define JOURNAL_DEFAULT_RATIO 2
+#define JOURNAL_MIN_BYTES (1ull << 20)    // never compact below this
+
+typedef enum JOURNAL_OP {
+    JOURNAL_PUT,
+    JOURNAL_DEL
+} JOURNAL_OP;
+
+// Record layout: header, then key, body and content type without terminators
+typedef struct journal_record {
+    uint32_t op;
+    uint32_t key_len;
+    uint32_t data_len;
+    uint32_t type_len;
+    int64_t response_code;
+    uint64_t time;
+} journal_record;
+
+/**
+ * Append only log of the cache puts and deletes since the last snapshot, kept
+ * next to it as 'path.journal'. Saving only has to sync the journal, so its
+ * cost follows the changes instead of the cache size.
+ *
+ * Writes only append to a memory buffer under a short lock. Writing the
+ * buffer out, syncing and compacting is left to journal_maintain() on the
+ * persistence thread, which swaps the buffer out and does the file work
+ * under a lock of its own, so a writer never waits on the disk. Once the journal outgrows
+ * 'ratio' times the live cache bytes it is rotated to 'path.journal.old', a
+ * fresh snapshot is written and the old journal dropped. Replaying is
+ * idempotent, a crash at any point only replays a journal whose records the
+ * snapshot may already hold. Every function is thread safe.
+ */
+struct journal {
+    struct mutex mtx;            // buffer and bytes
+    char* buf;
+    size_t len;
+    size_t cap;
+    struct mutex io;             // file
+    FILE* fp;
+    struct cache* cache;
+    struct snapshot* base;       // lazily loaded snapshot, records left in it are kept
+    char* path;                  // snapshot
+    char* log;                   // path.journal
+    char* old;                   // path.journal.old
+    uint64_t bytes;              // journaled since the last compaction
+    uint64_t ratio;
+    uint64_t compactions;
+};
+
+/**
+ * Replay the journal left by the last session into the cache, then open it
+ * for appending. With a base snapshot every journaled key consumes its
+ * record there and compactions copy the records left.
+ * @param j       journal
+ * @param c       cache the journal records
+ * @param base    snapshot the cache is faulted in from, may be NULL
+ * @param path    snapshot file
+ * @param ratio   journal to live bytes ratio that triggers a compaction
+ * @return        'true' on success.
+ */
+bool journal_open(struct journal* j, struct cache* c, struct snapshot* base, const char* path, uint64_t ratio);
+
+/**
+ * Syncs and closes the journal.
+ * @param j journal
+ */
+void journal_close(struct journal* j);
+
+/**
+ * @param j     journal
+ * @param key   key
+ * @param value value now in the cache
+ */
+void journal_put(struct journal* j, const char* key, const response_data* value);
+
+/**
+ * @param j   journal
+ * @param key key removed from the cache
+ */
+void journal_del(struct journal* j, const char* key);
+
+/**
+ * Flush and sync every buffered record.
+ * @param j journal
+ * @return  'true' on success.
+ */
+bool journal_sync(struct journal* j);
+
+/**
+ * Sync, then compact if the journal outgrew its ratio. Blocks for as long as
+ * a snapshot takes to write, so it belongs on a background thread and only
+ * one thread may call it.
+ * @param j journal
+ * @return  'true' on success.
+ */
+bool journal_maintain(struct journal* j);
+
+#endif
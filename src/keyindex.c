@@ -0,0 +1,262 @@
+#include "keyindex.h"
+
+// Endpoint of a "/METHOD/endpoint?params" key
+const char* key_index_path(const char* key, size_t* len) {
+    const char* path = *key ? strchr(key + 1, '/') : NULL;
+    path = path ? path + 1 : key;
+    *len = strcspn(path, "?");
+    return path;
+}
+
+bool key_index_match(const char* key, const char* prefix) {
+    size_t len, n = strlen(prefix);
+    const char* path = key_index_path(key, &len);
+    return len >= n && !memcmp(path, prefix, n) &&
+           (len == n || n == 0 || prefix[n - 1] == '/' || path[n] == '/');
+}
+
+struct key_node* key_node_create(const char* edge, uint32_t len) {
+    struct key_node* node = malloc(sizeof(struct key_node));
+    *node = (struct key_node) {.edge = malloc(len + 1), .edge_len = len};
+    memcpy(node->edge, edge, len);
+    node->edge[len] = '\0';
+    map_init_sv(&node->ids, 0, 0);
+    map_set_max_size(&node->ids, UINT32_MAX);
+    return node;
+}
+
+void key_node_link(struct key_node* parent, struct key_node* child) {
+    parent->children = realloc(parent->children, (parent->count + 1) * sizeof(struct key_node*));
+    parent->children[parent->count++] = child;
+    child->parent = parent;
+}
+
+void key_node_free(struct key_node* node) {
+    for (uint32_t i = 0; i < node->count; i++)
+        key_node_free(node->children[i]);
+    map_term_sv(&node->ids);
+    free(node->children);
+    free(node->edge);
+    free(node);
+}
+
+struct key_node* key_node_child(struct key_node* node, char c) {
+    for (uint32_t i = 0; i < node->count; i++)
+        if (node->children[i]->edge[0] == c) return node->children[i];
+    return NULL;
+}
+
+uint32_t key_node_common(const struct key_node* node, const char* path, size_t len) {
+    uint32_t common = 0;
+    while (common < node->edge_len && common < len && node->edge[common] == path[common]) common++;
+    return common;
+}
+
+// Node of a path, splitting the edge it ends in if needed
+struct key_node* key_node_insert(struct key_node* node, const char* path, size_t len) {
+    while (len) {
+        struct key_node* child = key_node_child(node, *path);
+        if (!child) {
+            child = key_node_create(path, len);
+            key_node_link(node, child);
+            return child;
+        }
+
+        uint32_t common = key_node_common(child, path, len);
+        if (common < child->edge_len) {
+            struct key_node* mid = key_node_create(child->edge, common);
+            for (uint32_t i = 0; i < node->count; i++)
+                if (node->children[i] == child) node->children[i] = mid;
+            mid->parent = node;
+            memmove(child->edge, child->edge + common, child->edge_len - common + 1);
+            child->edge_len -= common;
+            key_node_link(mid, child);
+            child = mid;
+        }
+        node = child;
+        path += common;
+        len -= common;
+    } return node;
+}
+
+// Frees the nodes left without keys or children up the path
+void key_node_prune(struct key_node* node) {
+    while (node->parent && node->ids.size == 0 && node->count == 0) {
+        struct key_node* parent = node->parent;
+        for (uint32_t i = 0; i < parent->count; i++) {
+            if (parent->children[i] != node) continue;
+            parent->children[i] = parent->children[--parent->count];
+            break;
+        }
+        key_node_free(node);
+        node = parent;
+    }
+}
+
+// Unlinks an entry from the trie and its tags, the key is left to the caller
+void key_entry_drop(struct key_index* ix, struct key_entry* e) {
+    map_del_sv(&e->node->ids, e->key);
+    for (uint32_t i = 0; i < e->count; i++) {
+        struct key_tag* tag = e->tags[i];
+        map_del_sv(&tag->ids, e->key);
+        if (tag->ids.size) continue;
+        map_del_sv(&ix->tags, tag->name);
+        map_term_sv(&tag->ids);
+        free(tag->name);
+        free(tag);
+    }
+    map_del_sv(&ix->entries, e->key);
+    key_node_prune(e->node);
+    free(e->tags);
+    free(e);
+}
+
+void key_index_init(struct key_index* ix) {
+    ix->root = (struct key_node) {.edge = NULL};
+    map_init_sv(&ix->root.ids, 0, 0);
+    map_set_max_size(&ix->root.ids, UINT32_MAX);
+    map_init_sv(&ix->entries, 0, 0);
+    map_set_max_size(&ix->entries, UINT32_MAX);
+    map_init_sv(&ix->tags, 0, 0);
+    map_set_max_size(&ix->tags, UINT32_MAX);
+    mutex_init(&ix->mtx);
+}
+
+void key_index_term(struct key_index* ix) {
+    const char* name; void* value;
+    map_foreach(&ix->entries, name, value) {
+        struct key_entry* e = (struct key_entry*) value;
+        free(e->key);
+        free(e->tags);
+        free(e);
+    }
+    map_foreach(&ix->tags, name, value) {
+        struct key_tag* tag = (struct key_tag*) value;
+        map_term_sv(&tag->ids);
+        free(tag->name);
+        free(tag);
+    }
+    for (uint32_t i = 0; i < ix->root.count; i++)
+        key_node_free(ix->root.children[i]);
+    free(ix->root.children);
+    map_term_sv(&ix->root.ids);
+    map_term_sv(&ix->entries);
+    map_term_sv(&ix->tags);
+    mutex_term(&ix->mtx);
+}
+
+void key_index_add(struct key_index* ix, const char* key, char* const* tags, uint32_t count) {
+    mutex_lock(&ix->mtx);
+    struct key_entry* e = (struct key_entry*) map_get_sv(&ix->entries, key);
+    if (!e) {
+        size_t len;
+        const char* path = key_index_path(key, &len);
+        e = calloc(1, sizeof(struct key_entry));
+        e->key = strdup(key);
+        e->node = key_node_insert(&ix->root, path, len);
+        map_put_sv(&e->node->ids, e->key, e);
+        map_put_sv(&ix->entries, e->key, e);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct key_tag* tag = (struct key_tag*) map_get_sv(&ix->tags, tags[i]);
+        if (tag && map_get_sv(&tag->ids, e->key)) continue;
+        if (!tag) {
+            tag = malloc(sizeof(struct key_tag));
+            tag->name = strdup(tags[i]);
+            map_init_sv(&tag->ids, 0, 0);
+            map_set_max_size(&tag->ids, UINT32_MAX);
+            map_put_sv(&ix->tags, tag->name, tag);
+        }
+        map_put_sv(&tag->ids, e->key, e);
+        e->tags = realloc(e->tags, (e->count + 1) * sizeof(struct key_tag*));
+        e->tags[e->count++] = tag;
+    }
+    mutex_unlock(&ix->mtx);
+}
+
+void key_index_remove(struct key_index* ix, const char* key) {
+    mutex_lock(&ix->mtx);
+    struct key_entry* e = (struct key_entry*) map_get_sv(&ix->entries, key);
+    if (e) {
+        char* owned = e->key;
+        key_entry_drop(ix, e);
+        free(owned);
+    }
+    mutex_unlock(&ix->mtx);
+}
+
+struct key_batch {
+    struct key_entry** entries;
+    uint32_t count;
+    uint32_t cap;
+};
+
+void key_batch_push(struct key_batch* b, struct key_entry* e) {
+    if (b->count == b->cap)
+        b->entries = realloc(b->entries, (b->cap = b->cap ? b->cap * 2 : 16) * sizeof(struct key_entry*));
+    b->entries[b->count++] = e;
+}
+
+void key_batch_node(struct key_batch* b, struct key_node* node, bool children) {
+    const char* key; void* e;
+    map_foreach(&node->ids, key, e) key_batch_push(b, (struct key_entry*) e);
+    for (uint32_t i = 0; children && i < node->count; i++)
+        key_batch_node(b, node->children[i], true);
+}
+
+// Drops the entries gathered, their keys go to the caller
+uint32_t key_batch_take(struct key_index* ix, struct key_batch* b, char*** keys) {
+    *keys = malloc((b->count ? b->count : 1) * sizeof(char*));
+    for (uint32_t i = 0; i < b->count; i++) {
+        (*keys)[i] = b->entries[i]->key;
+        key_entry_drop(ix, b->entries[i]);
+    }
+    free(b->entries);
+    return b->count;
+}
+
+uint32_t key_index_take_prefix(struct key_index* ix, const char* prefix, char*** keys) {
+    struct key_batch b = {0};
+    size_t n = strlen(prefix);
+    bool below = n == 0 || prefix[n - 1] == '/';
+
+    mutex_lock(&ix->mtx);
+    struct key_node* node = &ix->root;
+    while (node && n) {
+        struct key_node* child = key_node_child(node, *prefix);
+        uint32_t common = child ? key_node_common(child, prefix, n) : 0;
+        if (!child || (common < n && common < child->edge_len)) {
+            node = NULL;
+        } else if (common == n && common < child->edge_len) {
+            // the prefix ends inside the edge, which has to continue at a segment
+            if (below || child->edge[common] == '/') key_batch_node(&b, child, true);
+            node = NULL;
+        } else {
+            node = child;
+            prefix += common;
+            n -= common;
+        }
+    }
+
+    if (node) {
+        key_batch_node(&b, node, false);
+        for (uint32_t i = 0; i < node->count; i++)
+            if (below || node->children[i]->edge[0] == '/') key_batch_node(&b, node->children[i], true);
+    }
+    uint32_t count = key_batch_take(ix, &b, keys);
+    mutex_unlock(&ix->mtx);
+    return count;
+}
+
+uint32_t key_index_take_tag(struct key_index* ix, const char* tag, char*** keys) {
+    struct key_batch b = {0};
+    const char* key; void* e;
+
+    mutex_lock(&ix->mtx);
+    struct key_tag* t = (struct key_tag*) map_get_sv(&ix->tags, tag);
+    if (t) map_foreach(&t->ids, key, e) key_batch_push(&b, (struct key_entry*) e);
+    uint32_t count = key_batch_take(ix, &b, keys);
+    mutex_unlock(&ix->mtx);
+    return count;
+}
@@ -0,0 +1,96 @@
+#ifndef OAUTH_KEYINDEX_H
+#define OAUTH_KEYINDEX_H
+
+#include <OAuth.h>
+
+// Radix trie node, 'ids' holds the keys of exactly its path
+struct key_node {
+    char* edge;                  // bytes after the parent's path
+    uint32_t edge_len;
+    uint32_t count;
+    struct key_node** children;
+    struct key_node* parent;
+    struct map_sv ids;           // key to key_entry
+};
+
+struct key_tag {
+    char* name;
+    struct map_sv ids;           // key to key_entry
+};
+
+struct key_entry {
+    char* key;                   // owned, the maps borrow it
+    struct key_node* node;
+    uint32_t count;
+    struct key_tag** tags;
+};
+
+/**
+ * Index of the cached keys by endpoint path and by caller supplied tags, so
+ * invalidating takes time proportional to the keys it finds. Keys have the
+ * "/METHOD/endpoint?params" form, the path is the endpoint up to its query.
+ *
+ * A prefix matches whole path segments: "x/anime/1" matches "x/anime/1" and
+ * "x/anime/1/stats" but not "x/anime/12", a prefix ending in '/' matches
+ * anything below it. Keys are only dropped when told to, so the index may
+ * still hold a key the cache lost meanwhile. Every function is thread safe.
+ */
+struct key_index {
+    struct mutex mtx;
+    struct key_node root;
+    struct map_sv entries;       // key to key_entry
+    struct map_sv tags;          // name to key_tag
+};
+
+/**
+ * @param ix index
+ */
+void key_index_init(struct key_index* ix);
+
+/**
+ * @param ix index
+ */
+void key_index_term(struct key_index* ix);
+
+/**
+ * Index a key, or add tags to one indexed already.
+ * @param ix    index
+ * @param key   key
+ * @param tags  tags, may be NULL
+ * @param count number of tags
+ */
+void key_index_add(struct key_index* ix, const char* key, char* const* tags, uint32_t count);
+
+/**
+ * @param ix  index
+ * @param key key
+ */
+void key_index_remove(struct key_index* ix, const char* key);
+
+/**
+ * Remove every key under a path prefix.
+ * @param ix     index
+ * @param prefix endpoint prefix, "" for everything
+ * @param keys   set to the removed keys, the array and every key are owned by
+ *               the caller
+ * @return       number of keys.
+ */
+uint32_t key_index_take_prefix(struct key_index* ix, const char* prefix, char*** keys);
+
+/**
+ * Remove every key carrying a tag.
+ * @param ix   index
+ * @param tag  tag
+ * @param keys same as key_index_take_prefix()
+ * @return     number of keys.
+ */
+uint32_t key_index_take_tag(struct key_index* ix, const char* tag, char*** keys);
+
+/**
+ * @param key    key
+ * @param prefix endpoint prefix
+ * @return       'true' if key_index_take_prefix() would take 'key'.
+ */
+bool key_index_match(const char* key, const char* prefix);
+
+#endif
@@ -0,0 +1,45 @@
+#include "persist.h"
+
+void* persist_run(void* arg) {
+    struct persist* p = (struct persist*) arg;
+    uint64_t dirty;
+
+    while (atomic_get(&p->run)) {
+        for (uint64_t slept = 0; slept < p->interval_ms && atomic_get(&p->run); slept += PERSIST_SLICE_MS)
+            time_sleep(p->interval_ms - slept < PERSIST_SLICE_MS ? p->interval_ms - slept : PERSIST_SLICE_MS);
+        if ((dirty = (uint64_t) atomic_xchg(&p->dirty, 0))) {
+            p->flush(p->arg, dirty);
+            atomic_add(&p->flushes, 1);
+        }
+    }
+
+    // the last changes before the stop
+    if ((dirty = (uint64_t) atomic_xchg(&p->dirty, 0)))
+        p->flush(p->arg, dirty);
+    return NULL;
+}
+
+bool persist_start(struct persist* p, uint64_t interval_ms, void (*flush)(void* arg, uint64_t dirty), void* arg) {
+    if (!atomic_cas(&p->run, 0, 1)) return true;
+    // a zero interval would spin on 'dirty'
+    p->interval_ms = interval_ms < PERSIST_SLICE_MS ? PERSIST_SLICE_MS : interval_ms;
+    p->flush = flush;
+    p->arg = arg;
+    thread_init(&p->th);
+    if (thread_start(&p->th, persist_run, p)) {
+        atomic_set(&p->run, 0);
+        return false;
+    } return true;
+}
+
+void persist_stop(struct persist* p) {
+    if (!atomic_cas(&p->run, 1, 0)) return;
+    thread_join(&p->th, NULL);
+}
+
+void persist_mark(struct persist* p, uint64_t what) {
+    uint64_t cur = (uint64_t) atomic_get(&p->dirty);
+    // read first, a hot path marking the same bit again stays off the line
+    while ((cur & what) != what && !atomic_cas(&p->dirty, cur, cur | what))
+        cur = (uint64_t) atomic_get(&p->dirty);
+}
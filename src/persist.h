@@ -0,0 +1,54 @@
+#ifndef OAUTH_PERSIST_H
+#define OAUTH_PERSIST_H
+
+#include <OAuth.h>
+
+#define PERSIST_DEFAULT_MS 1000
+#define PERSIST_SLICE_MS 20      // shortest interval, and longest persist_stop() waits
+
+// What a dirty notification asks to write
+typedef enum PERSIST {
+    PERSIST_CONFIG = 1,
+    PERSIST_CACHE = 2,
+    PERSIST_SPILL = 4
+} PERSIST;
+
+/**
+ * Write behind worker. Callers only mark what changed, the worker wakes up
+ * once per interval and hands everything marked since its last run to
+ * 'flush', so any number of changes in between cost a single write and no
+ * caller ever waits on the disk.
+ */
+struct persist {
+    struct thread th;
+    uint64_t run;
+    uint64_t dirty;
+    uint64_t interval_ms;
+    void (*flush)(void* arg, uint64_t dirty);
+    void* arg;
+    uint64_t flushes;
+};
+
+/**
+ * Start the worker, does nothing if it runs already.
+ * @param p           persist
+ * @param interval_ms how long changes are coalesced, at least PERSIST_SLICE_MS
+ * @param flush       writes the PERSIST bits it is given
+ * @param arg         flush argument
+ * @return            'true' if the worker runs.
+ */
+bool persist_start(struct persist* p, uint64_t interval_ms, void (*flush)(void* arg, uint64_t dirty), void* arg);
+
+/**
+ * Stop the worker after it flushed whatever is still marked.
+ * @param p persist
+ */
+void persist_stop(struct persist* p);
+
+/**
+ * @param p    persist
+ * @param what PERSIST bits
+ */
+void persist_mark(struct persist* p, uint64_t what);
+
+#endif
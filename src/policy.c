@@ -0,0 +1,280 @@
+#include "cache.h"
+
+// CLOCK: entries sit in a ring in insertion order, the hand clears set
+// referenced bits until it meets an entry nobody read since its last pass.
+// Swap-remove moves the tail around, so the entry inserted last is tracked
+// and skipped while anything else is left to evict.
+
+struct policy_clock {
+    struct cache_entry** ring;
+    struct cache_entry* newest;
+    uint32_t size;
+    uint32_t hand;
+};
+
+void* policy_clock_create(uint32_t capacity) {
+    struct policy_clock* p = calloc(1, sizeof(struct policy_clock));
+    p->ring = malloc((capacity + 1) * sizeof(struct cache_entry*));
+    return p;
+}
+
+void policy_clock_destroy(void* state) {
+    struct policy_clock* p = (struct policy_clock*) state;
+    free(p->ring);
+    free(p);
+}
+
+void policy_clock_insert(void* state, struct cache_entry* entry) {
+    struct policy_clock* p = (struct policy_clock*) state;
+    entry->slot = p->size;
+    p->ring[p->size++] = entry;
+    p->newest = entry;
+}
+
+void policy_clock_replace(void* state, struct cache_entry* old, struct cache_entry* entry) {
+    struct policy_clock* p = (struct policy_clock*) state;
+    entry->slot = old->slot;
+    p->ring[entry->slot] = entry;
+    p->newest = entry;
+}
+
+void policy_clock_remove(void* state, struct cache_entry* entry) {
+    struct policy_clock* p = (struct policy_clock*) state;
+    if (p->newest == entry) p->newest = NULL;
+    p->ring[entry->slot] = p->ring[--p->size];
+    p->ring[entry->slot]->slot = entry->slot;
+}
+
+struct cache_entry* policy_clock_evict(void* state) {
+    struct policy_clock* p = (struct policy_clock*) state;
+    if (p->size == 0) return NULL;
+
+    p->hand %= p->size;
+    for (;; p->hand = (p->hand + 1) % p->size) {
+        struct cache_entry* entry = p->ring[p->hand];
+        if (entry == p->newest && p->size > 1) continue;
+        if (!atomic_get(&entry->referenced)) break;
+        atomic_set(&entry->referenced, 0);
+    }
+
+    struct cache_entry* victim = p->ring[p->hand];
+    if (p->newest == victim) p->newest = NULL;
+    p->ring[p->hand] = p->ring[--p->size];
+    p->ring[p->hand]->slot = p->hand;
+    return victim;
+}
+
+static const struct cache_policy POLICY_CLOCK_IMPL = {
+    .create = policy_clock_create,
+    .destroy = policy_clock_destroy,
+    .insert = policy_clock_insert,
+    .replace = policy_clock_replace,
+    .remove = policy_clock_remove,
+    .evict = policy_clock_evict
+};
+
+// W-TinyLFU: new entries enter a window of about 1% of the capacity, what
+// falls out of it competes with the main space's victim and only the one a
+// count-min sketch has seen more often stays. The main space is a segmented
+// LRU, probation and protected with 80% of it. Readers can not relink the
+// lists, so recency comes from the referenced bits: a set bit gives window
+// and protected entries a second chance and promotes probation entries when
+// they reach the tail.
+//
+// The sketch keeps four 4 bit counters per key, 16 to a word, and is halved
+// once it counted ten times the capacity so old popularity fades out.
+
+#define TINYLFU_WINDOW 0
+#define TINYLFU_PROBATION 1
+#define TINYLFU_PROTECTED 2
+
+static const uint32_t TINYLFU_SEEDS[] = {0x97cb3127u, 0xb492b66fu, 0x9ae16a3bu, 0xcbf29ce4u};
+
+struct tinylfu_queue {
+    struct cache_entry* head; // newest
+    struct cache_entry* tail;
+    uint32_t size;
+};
+
+struct policy_tinylfu {
+    uint64_t* sketch;
+    uint32_t mask;
+    uint64_t additions;      // counter increments since the last halving
+    uint64_t sample_size;
+    struct tinylfu_queue queues[3];
+    struct cache_entry* candidate; // last entry moved out of the window
+    uint32_t window_max;
+    uint32_t protected_max;
+};
+
+uint32_t tinylfu_index(uint32_t hash, int i, uint32_t* shift) {
+    uint32_t h = (hash + TINYLFU_SEEDS[i]) * 0x9E3779B1u;
+    h ^= h >> 15;
+    *shift = (h & 15) << 2;
+    return h >> 4;
+}
+
+uint32_t tinylfu_frequency(struct policy_tinylfu* p, uint32_t hash) {
+    uint32_t freq = 15, shift;
+    for (int i = 0; i < 4; i++) {
+        uint32_t index = tinylfu_index(hash, i, &shift) & p->mask;
+        uint32_t count = (uint32_t) ((uint64_t) atomic_get(&p->sketch[index]) >> shift) & 15;
+        if (count < freq) freq = count;
+    } return freq;
+}
+
+// Saturated counters are only read, so a hot key stops costing writes
+void tinylfu_increment(struct policy_tinylfu* p, uint32_t hash) {
+    uint32_t shift;
+    bool added = false;
+    for (int i = 0; i < 4; i++) {
+        uint64_t* word = &p->sketch[tinylfu_index(hash, i, &shift) & p->mask];
+        uint64_t cur = (uint64_t) atomic_get(word);
+        while (((cur >> shift) & 15) < 15 && !atomic_cas(word, cur, cur + (1ull << shift)))
+            cur = (uint64_t) atomic_get(word);
+        added |= ((cur >> shift) & 15) < 15;
+    }
+    if (added) atomic_add(&p->additions, 1);
+}
+
+void tinylfu_age(struct policy_tinylfu* p) {
+    if ((uint64_t) atomic_get(&p->additions) < p->sample_size) return;
+    for (uint32_t i = 0; i <= p->mask; i++) {
+        uint64_t cur = (uint64_t) atomic_get(&p->sketch[i]);
+        while (!atomic_cas(&p->sketch[i], cur, (cur >> 1) & 0x7777777777777777ull))
+            cur = (uint64_t) atomic_get(&p->sketch[i]);
+    }
+    atomic_set(&p->additions, 0);
+}
+
+void tinylfu_push(struct policy_tinylfu* p, uint8_t queue, struct cache_entry* entry) {
+    struct tinylfu_queue* q = &p->queues[queue];
+    entry->queue = queue;
+    entry->newer = NULL;
+    entry->older = q->head;
+    if (q->head) q->head->newer = entry;
+    else q->tail = entry;
+    q->head = entry;
+    q->size++;
+}
+
+void tinylfu_remove(struct policy_tinylfu* p, struct cache_entry* entry) {
+    struct tinylfu_queue* q = &p->queues[entry->queue];
+    if (entry->newer) entry->newer->older = entry->older;
+    else q->head = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else q->tail = entry->newer;
+    q->size--;
+    if (p->candidate == entry) p->candidate = NULL;
+}
+
+// Second chance at the tail of 'queue', returns the first unreferenced entry
+struct cache_entry* tinylfu_tail(struct policy_tinylfu* p, uint8_t queue) {
+    struct tinylfu_queue* q = &p->queues[queue];
+    for (uint32_t i = 0; q->tail && i < q->size; i++) {
+        struct cache_entry* entry = q->tail;
+        if (!atomic_get(&entry->referenced)) break;
+        atomic_set(&entry->referenced, 0);
+        tinylfu_remove(p, entry);
+        tinylfu_push(p, queue, entry);
+    } return q->tail;
+}
+
+void* policy_tinylfu_create(uint32_t capacity) {
+    struct policy_tinylfu* p = calloc(1, sizeof(struct policy_tinylfu));
+    uint32_t words = 16;
+    while (words < capacity) words *= 2;
+    p->sketch = calloc(words, sizeof(uint64_t));
+    p->mask = words - 1;
+    p->sample_size = 10ull * (capacity ? capacity : 1);
+    p->window_max = capacity / 100 ? capacity / 100 : 1;
+    p->protected_max = (capacity - p->window_max) * 4 / 5;
+    return p;
+}
+
+void policy_tinylfu_destroy(void* state) {
+    struct policy_tinylfu* p = (struct policy_tinylfu*) state;
+    free(p->sketch);
+    free(p);
+}
+
+void policy_tinylfu_remove(void* state, struct cache_entry* entry) {
+    tinylfu_remove((struct policy_tinylfu*) state, entry);
+}
+
+void policy_tinylfu_access(void* state, struct cache_entry* entry) {
+    tinylfu_increment((struct policy_tinylfu*) state, entry->hash);
+}
+
+void policy_tinylfu_insert(void* state, struct cache_entry* entry) {
+    struct policy_tinylfu* p = (struct policy_tinylfu*) state;
+    tinylfu_age(p);
+    tinylfu_increment(p, entry->hash);
+    tinylfu_push(p, TINYLFU_WINDOW, entry);
+
+    if (p->queues[TINYLFU_WINDOW].size > p->window_max) {
+        struct cache_entry* out = tinylfu_tail(p, TINYLFU_WINDOW);
+        tinylfu_remove(p, out);
+        tinylfu_push(p, TINYLFU_PROBATION, out);
+        p->candidate = out;
+    }
+}
+
+void policy_tinylfu_replace(void* state, struct cache_entry* old, struct cache_entry* entry) {
+    struct policy_tinylfu* p = (struct policy_tinylfu*) state;
+    struct tinylfu_queue* q = &p->queues[old->queue];
+    entry->queue = old->queue;
+    entry->newer = old->newer;
+    entry->older = old->older;
+    if (entry->newer) entry->newer->older = entry;
+    else q->head = entry;
+    if (entry->older) entry->older->newer = entry;
+    else q->tail = entry;
+    if (p->candidate == old) p->candidate = entry;
+}
+
+struct cache_entry* policy_tinylfu_evict(void* state) {
+    struct policy_tinylfu* p = (struct policy_tinylfu*) state;
+    struct tinylfu_queue* probation = &p->queues[TINYLFU_PROBATION];
+    struct tinylfu_queue* protect = &p->queues[TINYLFU_PROTECTED];
+
+    // promote what was read while on probation, demote protected overflow
+    for (uint32_t i = 0, n = probation->size; probation->tail && i < n; i++) {
+        struct cache_entry* entry = probation->tail;
+        if (!atomic_get(&entry->referenced)) break;
+        atomic_set(&entry->referenced, 0);
+        tinylfu_remove(p, entry);
+        tinylfu_push(p, TINYLFU_PROTECTED, entry);
+        if (protect->size > p->protected_max) {
+            struct cache_entry* out = tinylfu_tail(p, TINYLFU_PROTECTED);
+            tinylfu_remove(p, out);
+            tinylfu_push(p, TINYLFU_PROBATION, out);
+        }
+    }
+
+    struct cache_entry* victim = probation->tail;
+    struct cache_entry* candidate = p->candidate;
+    p->candidate = NULL;
+    if (!victim) victim = tinylfu_tail(p, protect->size ? TINYLFU_PROTECTED : TINYLFU_WINDOW);
+    else if (candidate && candidate != victim &&
+             tinylfu_frequency(p, candidate->hash) <= tinylfu_frequency(p, victim->hash))
+        victim = candidate;
+
+    if (victim) tinylfu_remove(p, victim);
+    return victim;
+}
+
+static const struct cache_policy POLICY_TINYLFU_IMPL = {
+    .create = policy_tinylfu_create,
+    .destroy = policy_tinylfu_destroy,
+    .access = policy_tinylfu_access,
+    .insert = policy_tinylfu_insert,
+    .replace = policy_tinylfu_replace,
+    .remove = policy_tinylfu_remove,
+    .evict = policy_tinylfu_evict
+};
+
+const struct cache_policy* CACHE_POLICIES[NUM_POLICIES] = {
+    &POLICY_CLOCK_IMPL,
+    &POLICY_TINYLFU_IMPL
+};
@@ -0,0 +1,332 @@
+#include "snapshot.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <stdio.h>
+#include <io.h>
+#define snapshot_fsync(fp) _commit(_fileno(fp))
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define snapshot_fsync(fp) fsync(fileno(fp))
+#endif
+
+#define SNAPSHOT_ALIGN(x) (((x) + 7) & ~(uint64_t) 7)
+
+uint64_t snapshot_record_size(const snapshot_record* rec) {
+    return SNAPSHOT_ALIGN(sizeof(*rec) + (uint64_t) rec->key_len + rec->data_len + rec->type_len + 3);
+}
+
+// Checks a record lies inside the records area before anything reads it
+const snapshot_record* snapshot_record_at(const struct snapshot* s, uint64_t offset) {
+    if (offset < sizeof(snapshot_header) || offset + sizeof(snapshot_record) > s->header->index_offset)
+        return NULL;
+    const snapshot_record* rec = (const snapshot_record*) (s->base + offset);
+    return offset + snapshot_record_size(rec) <= s->header->index_offset ? rec : NULL;
+}
+
+void snapshot_value(const snapshot_record* rec, const char** key, response_data* value) {
+    const char* p = (const char*) (rec + 1);
+    *key = p;
+    *value = (response_data) {
+        .data = p + rec->key_len + 1,
+        .content_type = p + rec->key_len + rec->data_len + 2,
+        .response_code = (long) rec->response_code,
+        .time = rec->time
+    };
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// No mmap, the file is read into one buffer which is served the same way
+const char* snapshot_map(const char* path, uint64_t* size) {
+    FILE* fp = fopen(path, "rb");
+    char* base = NULL;
+    long len;
+    if (!fp) return NULL;
+    if (!fseek(fp, 0, SEEK_END) && (len = ftell(fp)) > 0 && !fseek(fp, 0, SEEK_SET) &&
+        (base = malloc(len)) && fread(base, 1, len, fp) != (size_t) len) {
+        free(base);
+        base = NULL;
+    }
+    fclose(fp);
+    *size = base ? (uint64_t) len : 0;
+    return base;
+}
+
+void snapshot_unmap(const char* base, uint64_t size) {
+    free((char*) base);
+}
+
+#else
+
+const char* snapshot_map(const char* path, uint64_t* size) {
+    struct stat st;
+    void* base = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    return (const char*) base;
+}
+
+void snapshot_unmap(const char* base, uint64_t size) {
+    munmap((void*) base, size);
+}
+
+#endif
+
+bool snapshot_open(struct snapshot* s, const char* path) {
+    *s = (struct snapshot) {0};
+    if (!(s->base = snapshot_map(path, &s->size))) return false;
+
+    const snapshot_header* h = (const snapshot_header*) s->base;
+    bool ok = s->size >= sizeof(*h) && h->magic == SNAPSHOT_MAGIC && h->version == SNAPSHOT_VERSION &&
+              h->file_size == s->size && h->index_cap && !(h->index_cap & (h->index_cap - 1)) &&
+              h->index_offset >= sizeof(*h) && !(h->index_offset & 7) &&
+              h->index_offset + (uint64_t) h->index_cap * sizeof(snapshot_slot) <= s->size;
+
+    if (!ok) {
+        snapshot_unmap(s->base, s->size);
+        *s = (struct snapshot) {0};
+        return false;
+    }
+
+    s->header = h;
+    s->index = (const snapshot_slot*) (s->base + h->index_offset);
+    s->consumed = calloc((h->index_cap + 63) / 64, sizeof(uint64_t));
+    return true;
+}
+
+void snapshot_close(struct snapshot* s) {
+    if (s->base) snapshot_unmap(s->base, s->size);
+    free(s->consumed);
+    *s = (struct snapshot) {0};
+}
+
+// Index slot of a key, -1 if the snapshot does not have it
+int64_t snapshot_slot_of(const struct snapshot* s, const char* key, response_data* value) {
+    if (!s->base) return -1;
+    uint32_t hash = murmurhash(key);
+    uint32_t mask = s->header->index_cap - 1;
+    const char* k;
+
+    for (uint32_t i = hash & mask, n = 0; n <= mask && s->index[i].offset; i = (i + 1) & mask, n++) {
+        if (s->index[i].hash != hash) continue;
+        const snapshot_record* rec = snapshot_record_at(s, s->index[i].offset);
+        if (!rec) return -1;
+        snapshot_value(rec, &k, value);
+        if (!strcmp(k, key)) return i;
+    } return -1;
+}
+
+// Sets the bit of a slot, 'false' if it was set already
+bool snapshot_mark(struct snapshot* s, uint32_t slot) {
+    uint64_t* word = &s->consumed[slot / 64];
+    uint64_t bit = 1ull << (slot % 64);
+    uint64_t cur = (uint64_t) atomic_get(word);
+    while (!(cur & bit) && !atomic_cas(word, cur, cur | bit))
+        cur = (uint64_t) atomic_get(word);
+    return !(cur & bit);
+}
+
+bool snapshot_consumed(const struct snapshot* s, uint32_t slot) {
+    return (uint64_t) atomic_get(&s->consumed[slot / 64]) & (1ull << (slot % 64));
+}
+
+bool snapshot_find(const struct snapshot* s, const char* key, response_data* value) {
+    return snapshot_slot_of(s, key, value) >= 0;
+}
+
+bool snapshot_take(struct snapshot* s, const char* key, response_data* value) {
+    int64_t slot = snapshot_slot_of(s, key, value);
+    return slot >= 0 && snapshot_mark(s, (uint32_t) slot);
+}
+
+void snapshot_consume(struct snapshot* s, const char* key) {
+    response_data value;
+    int64_t slot = snapshot_slot_of(s, key, &value);
+    if (slot >= 0) snapshot_mark(s, (uint32_t) slot);
+}
+
+void snapshot_foreach(const struct snapshot* s, void (*fn)(void* arg, const char* key, const response_data* value), void* arg) {
+    if (!s->base) return;
+    const snapshot_record* rec;
+    const char* key;
+    response_data value;
+
+    for (uint64_t offset = sizeof(snapshot_header); (rec = snapshot_record_at(s, offset)); offset += snapshot_record_size(rec)) {
+        snapshot_value(rec, &key, &value);
+        fn(arg, key, &value);
+    }
+}
+
+void snapshot_foreach_live(struct snapshot* s, void (*fn)(void* arg, const char* key, const response_data* value), void* arg) {
+    if (!s->base) return;
+    const snapshot_record* rec;
+    const char* key;
+    response_data value;
+
+    for (uint32_t i = 0; i < s->header->index_cap; i++) {
+        if (!s->index[i].offset || snapshot_consumed(s, i)) continue;
+        if (!(rec = snapshot_record_at(s, s->index[i].offset))) continue;
+        snapshot_value(rec, &key, &value);
+        fn(arg, key, &value);
+    }
+}
+
+struct snapshot_range {
+    const struct snapshot* s;
+    uint32_t begin;
+    uint32_t end;
+    void (*fn)(void* arg, const char* key, const response_data* value);
+    void* arg;
+};
+
+void* snapshot_range_run(void* arg) {
+    struct snapshot_range* r = (struct snapshot_range*) arg;
+    const snapshot_record* rec;
+    const char* key;
+    response_data value;
+
+    for (uint32_t i = r->begin; i < r->end; i++) {
+        if (!r->s->index[i].offset || !(rec = snapshot_record_at(r->s, r->s->index[i].offset))) continue;
+        snapshot_value(rec, &key, &value);
+        r->fn(r->arg, key, &value);
+    } return NULL;
+}
+
+void snapshot_foreach_parallel(const struct snapshot* s, uint32_t threads,
+                               void (*fn)(void* arg, const char* key, const response_data* value), void* arg) {
+    if (!s->base) return;
+    if (threads <= 1) {
+        snapshot_foreach(s, fn, arg);
+        return;
+    }
+
+    uint32_t cap = s->header->index_cap;
+    if (threads > cap) threads = cap;
+    struct snapshot_range* ranges = calloc(threads, sizeof(struct snapshot_range));
+    struct thread* th = calloc(threads, sizeof(struct thread));
+    bool* started = calloc(threads, sizeof(bool));
+
+    for (uint32_t i = 0; i < threads; i++) {
+        ranges[i] = (struct snapshot_range) {
+            .s = s, .begin = (uint64_t) cap * i / threads, .end = (uint64_t) cap * (i + 1) / threads, .fn = fn, .arg = arg
+        };
+        // the caller takes the last range, and any a thread could not start for
+        if (i == threads - 1) continue;
+        thread_init(&th[i]);
+        started[i] = thread_start(&th[i], snapshot_range_run, &ranges[i]) == 0;
+    }
+
+    for (uint32_t i = 0; i < threads; i++)
+        if (!started[i]) snapshot_range_run(&ranges[i]);
+    for (uint32_t i = 0; i < threads; i++)
+        if (started[i]) thread_join(&th[i], NULL);
+
+    free(ranges);
+    free(th);
+    free(started);
+}
+
+struct snapshot_writer {
+    FILE* fp;
+    uint64_t offset;
+    snapshot_slot* slots;
+    uint32_t count;
+    uint32_t cap;
+    bool ok;
+};
+
+void snapshot_write_entry(void* arg, const char* key, response_data* value) {
+    struct snapshot_writer* w = (struct snapshot_writer*) arg;
+    static const char zeros[8] = {0};
+    if (!w->ok || !value->data) return;
+
+    const char* type = value->content_type ? value->content_type : "";
+    snapshot_record rec = {
+        .key_len = strlen(key),
+        .data_len = strlen(value->data),
+        .type_len = strlen(type),
+        .response_code = value->response_code,
+        .time = value->time
+    };
+    uint64_t size = snapshot_record_size(&rec);
+    uint64_t used = sizeof(rec) + (uint64_t) rec.key_len + rec.data_len + rec.type_len + 3;
+
+    if (w->count == w->cap)
+        w->slots = realloc(w->slots, (w->cap = w->cap ? w->cap * 2 : 64) * sizeof(snapshot_slot));
+    w->slots[w->count++] = (snapshot_slot) {.hash = murmurhash(key), .offset = w->offset};
+
+    w->ok = fwrite(&rec, sizeof(rec), 1, w->fp) == 1 &&
+            fwrite(key, 1, rec.key_len + 1, w->fp) == rec.key_len + 1 &&
+            fwrite(value->data, 1, rec.data_len + 1, w->fp) == rec.data_len + 1 &&
+            fwrite(type, 1, rec.type_len + 1, w->fp) == rec.type_len + 1 &&
+            fwrite(zeros, 1, size - used, w->fp) == size - used;
+    w->offset += size;
+}
+
+bool snapshot_write(struct cache* c, const struct snapshot* base, const char* path) {
+    char* tmp = str_create_fmt("%s.tmp", path);
+    snapshot_header h = {.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION};
+    struct snapshot_writer w = {.fp = fopen(tmp, "wb"), .offset = sizeof(h), .ok = true};
+
+    if (!w.fp) {
+        str_destroy(&tmp);
+        return false;
+    }
+
+    // header last, a torn write leaves a file snapshot_open() rejects
+    w.ok = fwrite(&h, sizeof(h), 1, w.fp) == 1;
+    cache_foreach(c, snapshot_write_entry, &w);
+
+    // a consumed record is either in the cache already or superseded, the
+    // peek covers a put that has not consumed its record yet
+    for (uint32_t i = 0; base && base->base && i < base->header->index_cap; i++) {
+        const snapshot_record* rec;
+        const char* key;
+        response_data value, cached;
+        if (!base->index[i].offset || snapshot_consumed(base, i) ||
+            !(rec = snapshot_record_at(base, base->index[i].offset))) continue;
+        snapshot_value(rec, &key, &value);
+        if (!cache_peek(c, key, &cached))
+            snapshot_write_entry(&w, key, &value);
+    }
+
+    h.count = w.count;
+    h.index_cap = 8;
+    while (h.index_cap < (uint64_t) w.count * 2) h.index_cap *= 2;
+    h.index_offset = w.offset;
+    h.file_size = w.offset + (uint64_t) h.index_cap * sizeof(snapshot_slot);
+
+    snapshot_slot* index = calloc(h.index_cap, sizeof(snapshot_slot));
+    for (uint32_t i = 0; i < w.count; i++) {
+        uint32_t pos = w.slots[i].hash & (h.index_cap - 1);
+        while (index[pos].offset) pos = (pos + 1) & (h.index_cap - 1);
+        index[pos] = w.slots[i];
+    }
+
+    w.ok = w.ok && fwrite(index, sizeof(snapshot_slot), h.index_cap, w.fp) == h.index_cap &&
+           !fseek(w.fp, 0, SEEK_SET) && fwrite(&h, sizeof(h), 1, w.fp) == 1;
+    // on disk before the rename, a crash must not leave a torn snapshot
+    w.ok = w.ok && !fflush(w.fp) && !snapshot_fsync(w.fp);
+    w.ok = !fclose(w.fp) && w.ok;
+    free(index);
+    free(w.slots);
+
+#if defined(_WIN32) || defined(_WIN64)
+    if (w.ok) remove(path);
+#endif
+    if (!w.ok || rename(tmp, path)) {
+        remove(tmp);
+        w.ok = false;
+    }
+
+    str_destroy(&tmp);
+    return w.ok;
+}
@@ -0,0 +1,131 @@
+#ifndef OAUTH_SNAPSHOT_H
+#define OAUTH_SNAPSHOT_H
+
+#include <OAuth.h>
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC 0x4643414fu    // "OACF" little endian
+#define SNAPSHOT_VERSION 1
+
+// File layout: header, records, index. All integers are native endian, the
+// magic doubles as a byte order check.
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;              // records
+    uint32_t index_cap;          // index slots, a power of two
+    uint64_t index_offset;
+    uint64_t file_size;
+} snapshot_header;
+
+// Open addressed by key hash, linear probing, offset 0 marks a free slot
+typedef struct snapshot_slot {
+    uint32_t hash;
+    uint32_t pad;
+    uint64_t offset;
+} snapshot_slot;
+
+// Record header, followed by key, body and content type, each terminated so
+// they can be handed out straight from the mapping. Records are 8 byte aligned.
+typedef struct snapshot_record {
+    uint32_t key_len;
+    uint32_t data_len;
+    uint32_t type_len;
+    uint32_t pad;
+    int64_t response_code;
+    uint64_t time;
+} snapshot_record;
+
+/**
+ * Read only view of a saved cache file. The whole file is mapped, opening it
+ * only validates the header and index so its cost does not depend on the
+ * size of the bodies, which stay in the mapping until snapshot_close().
+ *
+ * A record is consumed once the cache took it over or a newer put or delete
+ * of its key superseded it, one bit per index slot. Consumed records are no
+ * longer served and not copied into the next snapshot.
+ */
+struct snapshot {
+    const char* base;
+    uint64_t size;
+    const snapshot_header* header;
+    const snapshot_slot* index;
+    uint64_t* consumed;
+};
+
+/**
+ * @param s    snapshot
+ * @param path cache file
+ * @return     'true' if the file was mapped and is a valid snapshot.
+ */
+bool snapshot_open(struct snapshot* s, const char* path);
+
+/**
+ * Unmaps the file, every value handed out becomes invalid.
+ * @param s snapshot
+ */
+void snapshot_close(struct snapshot* s);
+
+/**
+ * @param s     snapshot
+ * @param key   key
+ * @param value set on success, points into the mapping.
+ * @return      'true' if the key was found.
+ */
+bool snapshot_find(const struct snapshot* s, const char* key, response_data* value);
+
+/**
+ * Find a key and consume its record, each record is taken at most once.
+ * @param s     snapshot
+ * @param key   key
+ * @param value set on success, points into the mapping.
+ * @return      'true' if the key was found and not consumed before.
+ */
+bool snapshot_take(struct snapshot* s, const char* key, response_data* value);
+
+/**
+ * Mark the record of a key consumed, if there is one.
+ * @param s   snapshot
+ * @param key key
+ */
+void snapshot_consume(struct snapshot* s, const char* key);
+
+/**
+ * Call 'fn' for every record in file order, values point into the mapping.
+ * @param s   snapshot
+ * @param fn  callback
+ * @param arg callback argument
+ */
+void snapshot_foreach(const struct snapshot* s, void (*fn)(void* arg, const char* key, const response_data* value), void* arg);
+
+/**
+ * Call 'fn' for every record not consumed yet, in index order.
+ * @param s   snapshot
+ * @param fn  callback, may consume the record it is given
+ * @param arg callback argument
+ */
+void snapshot_foreach_live(struct snapshot* s, void (*fn)(void* arg, const char* key, const response_data* value), void* arg);
+
+/**
+ * snapshot_foreach() split over 'threads' threads, each one takes a range of
+ * the index. Records come in no particular order and 'fn' has to be thread
+ * safe.
+ * @param s       snapshot
+ * @param threads threads including the caller
+ * @param fn      callback
+ * @param arg     callback argument
+ */
+void snapshot_foreach_parallel(const struct snapshot* s, uint32_t threads,
+                               void (*fn)(void* arg, const char* key, const response_data* value), void* arg);
+
+/**
+ * Write the cache to 'path.tmp' and rename it over 'path', an open snapshot
+ * of 'path' keeps its old contents.
+ * @param c    cache
+ * @param base when set, its records not consumed yet are written as well
+ * @param path cache file
+ * @return     'true' on success.
+ */
+bool snapshot_write(struct cache* c, const struct snapshot* base, const char* path);
+
+#endif
@@ -0,0 +1,406 @@
+#include "spill.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define spill_lock_file(fp) _lock_file(fp)
+#define spill_unlock_file(fp) _unlock_file(fp)
+#else
+#define spill_lock_file(fp) flockfile(fp)
+#define spill_unlock_file(fp) funlockfile(fp)
+#endif
+
+map_def_strkey(spill, const char*, spill_loc, cmp_str, murmurhash, {.key = 0})
+map_def_strkey(spill_queue, const char*, spill_pending, cmp_str, murmurhash, {.key = 0})
+
+// Record layout: header, then key, body and content type without terminators
+typedef struct spill_record {
+    uint32_t key_len;
+    uint32_t data_len;
+    uint32_t type_len;
+    uint32_t pad;
+    int64_t response_code;
+    uint64_t time;
+} spill_record;
+
+// Live record copied by a compaction
+typedef struct spill_move {
+    char* key;
+    uint64_t offset;
+    uint64_t moved;
+    uint32_t length;
+} spill_move;
+
+void spill_forget(struct spill* s, const char* key) {
+    spill_loc loc = map_del_spill(&s->index, key);
+    if (!map_found(&s->index)) return;
+    s->live -= loc.length;
+    free(loc.key);
+}
+
+// Indexes a record written at 'offset', 'mtx' held
+void spill_index(struct spill* s, const char* key, uint64_t offset, uint32_t length) {
+    spill_forget(s, key);
+    spill_loc loc = {.key = strdup(key), .offset = offset, .length = length};
+    map_put_spill(&s->index, loc.key, loc);
+    s->live += length;
+}
+
+void spill_dropped(struct spill* s, const char* key) {
+    if (s->drop) s->drop(s->drop_arg, key);
+}
+
+struct spill_file* spill_file_open(const char* path, const char* mode) {
+    FILE* fp = fopen(path, mode);
+    if (!fp) return NULL;
+    struct spill_file* f = malloc(sizeof(struct spill_file));
+    *f = (struct spill_file) {.fp = fp, .users = 1};
+    return f;
+}
+
+// Drops a hold on a segment, the last one closes it
+void spill_file_release(struct spill* s, struct spill_file* f) {
+    mutex_lock(&s->mtx);
+    bool last = --f->users == 0;
+    mutex_unlock(&s->mtx);
+    if (!last) return;
+    fclose(f->fp);
+    free(f);
+}
+
+bool spill_open(struct spill* s, const char* path, uint64_t max_bytes) {
+    if (!(s->file = spill_file_open(path, "w+b"))) return false;
+    s->path = strdup(path);
+    s->end = s->live = s->compactions = 0;
+    s->max_bytes = max_bytes;
+    map_init_spill(&s->index, 0, 0);
+    map_set_max_size(&s->index, UINT32_MAX);
+    map_init_spill_queue(&s->queue, 0, 0);
+    map_set_max_size(&s->queue, UINT32_MAX);
+    map_init_spill_queue(&s->flushing, 0, 0);
+    map_set_max_size(&s->flushing, UINT32_MAX);
+    s->queued = 0;
+    mutex_init(&s->mtx);
+    mutex_init(&s->queue_mtx);
+    mutex_init(&s->io);
+    return true;
+}
+
+void spill_set_drop(struct spill* s, void (*fn)(void* arg, const char* key), void* arg) {
+    s->drop = fn;
+    s->drop_arg = arg;
+}
+
+void spill_pending_free(spill_pending* p) {
+    free(p->key);
+    free((char*) p->value.data);
+    free((char*) p->value.content_type);
+}
+
+void spill_close(struct spill* s) {
+    if (!s->path) return;
+    const char* key; spill_loc loc; spill_pending p;
+    map_foreach(&s->index, key, loc)
+        free(loc.key);
+    map_term_spill(&s->index);
+    map_foreach(&s->queue, key, p)
+        spill_pending_free(&p);
+    map_term_spill_queue(&s->queue);
+    map_term_spill_queue(&s->flushing);
+    mutex_term(&s->queue_mtx);
+    spill_file_release(s, s->file);
+    remove(s->path);
+    free(s->path);
+    mutex_term(&s->io);
+    mutex_term(&s->mtx);
+    s->file = NULL;
+    s->path = NULL;
+}
+
+// Reads the record at 'offset', its key, body and type go to '*buf'
+bool spill_read(FILE* fp, uint64_t offset, spill_record* rec, char** buf, size_t* cap) {
+    spill_lock_file(fp);
+    bool ok = !fseek(fp, offset, SEEK_SET) && fread(rec, sizeof(*rec), 1, fp) == 1;
+    size_t body = ok ? (size_t) rec->key_len + rec->data_len + rec->type_len : 0;
+    if (ok && body + 1 > *cap) *buf = realloc(*buf, *cap = body + 1);
+    ok = ok && fread(*buf, 1, body, fp) == body;
+    spill_unlock_file(fp);
+    return ok;
+}
+
+// Appends a record at the end of the segment, 'io' held
+bool spill_write(struct spill* s, const char* key, const response_data* value, uint64_t* offset, uint32_t* length) {
+    spill_record rec = {
+        .key_len = strlen(key),
+        .data_len = strlen(value->data),
+        .type_len = value->content_type ? strlen(value->content_type) : 0,
+        .response_code = value->response_code,
+        .time = value->time
+    };
+    FILE* fp = s->file->fp;
+    *offset = s->end;
+    *length = sizeof(rec) + rec.key_len + rec.data_len + rec.type_len;
+
+    spill_lock_file(fp);
+    bool ok = !fseek(fp, s->end, SEEK_SET) &&
+              fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+              fwrite(key, 1, rec.key_len, fp) == rec.key_len &&
+              fwrite(value->data, 1, rec.data_len, fp) == rec.data_len &&
+              (!rec.type_len || fwrite(value->content_type, 1, rec.type_len, fp) == rec.type_len);
+    spill_unlock_file(fp);
+    s->end += *length;
+    return ok;
+}
+
+int spill_move_cmp(const void* a, const void* b) {
+    uint64_t x = ((const spill_move*) a)->offset, y = ((const spill_move*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+// Copies the live records to a new file, dropping the oldest ones until the
+// rest fits in half of the budget, 'io' held. Readers keep the old segment
+// until they are done with it. On failure the old segment and its index are
+// left as they are.
+bool spill_compact(struct spill* s) {
+    const char* key; spill_loc loc;
+    uint32_t count = 0, dropped = 0;
+
+    mutex_lock(&s->mtx);
+    uint64_t drop = s->live > s->max_bytes / 2 ? s->live - s->max_bytes / 2 : 0;
+    spill_move* moves = malloc((s->index.size ? s->index.size : 1) * sizeof(spill_move));
+    map_foreach(&s->index, key, loc)
+        moves[count++] = (spill_move) {.key = strdup(loc.key), .offset = loc.offset, .length = loc.length};
+    qsort(moves, count, sizeof(spill_move), spill_move_cmp);
+    for (; dropped < count && drop; dropped++) {
+        drop = drop > moves[dropped].length ? drop - moves[dropped].length : 0;
+        spill_forget(s, moves[dropped].key);
+    }
+    struct spill_file* from = s->file;
+    mutex_unlock(&s->mtx);
+
+    for (uint32_t i = 0; i < dropped; i++)
+        spill_dropped(s, moves[i].key);
+
+    char* tmp = str_create_fmt("%s.tmp", s->path);
+    struct spill_file* to = spill_file_open(tmp, "w+b");
+    uint64_t written = 0;
+    char* buf = NULL;
+    size_t cap = 0;
+    spill_record rec;
+    bool ok = to != NULL;
+
+    // a record taken meanwhile is still copied, the index decides below
+    for (uint32_t i = dropped; ok && i < count; i++) {
+        if (!(ok = spill_read(from->fp, moves[i].offset, &rec, &buf, &cap))) break;
+        size_t body = (size_t) rec.key_len + rec.data_len + rec.type_len;
+        ok = fwrite(&rec, sizeof(rec), 1, to->fp) == 1 && fwrite(buf, 1, body, to->fp) == body;
+        moves[i].moved = written;
+        written += sizeof(rec) + body;
+    }
+    ok = ok && !fflush(to->fp) && !rename(tmp, s->path);
+    free(buf);
+
+    if (ok) {
+        mutex_lock(&s->mtx);
+        for (uint32_t i = dropped; i < count; i++) {
+            loc = map_get_spill(&s->index, moves[i].key);
+            if (!map_found(&s->index) || loc.offset != moves[i].offset) continue;
+            loc.offset = moves[i].moved;
+            map_put_spill(&s->index, loc.key, loc);
+        }
+        s->file = to;
+        mutex_unlock(&s->mtx);
+        s->end = written;
+        s->compactions++;
+        spill_file_release(s, from);
+    } else if (to) {
+        spill_file_release(s, to);
+        remove(tmp);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        free(moves[i].key);
+    free(moves);
+    str_destroy(&tmp);
+    return ok;
+}
+
+bool spill_put(struct spill* s, const char* key, const response_data* value) {
+    if (!s->path || !value->data) return false;
+    uint64_t offset;
+    uint32_t length;
+
+    mutex_lock(&s->io);
+    bool ok = spill_write(s, key, value, &offset, &length);
+    mutex_lock(&s->mtx);
+    if (ok) spill_index(s, key, offset, length);
+    else spill_forget(s, key);
+    mutex_unlock(&s->mtx);
+    if (!ok) spill_dropped(s, key);
+    if (s->max_bytes && s->end > s->max_bytes) spill_compact(s);
+    mutex_unlock(&s->io);
+    return ok;
+}
+
+bool spill_defer(struct spill* s, const char* key, const response_data* value) {
+    if (!s->path || !value->data) return false;
+    size_t data_len = strlen(value->data);
+    size_t type_len = value->content_type ? strlen(value->content_type) : 0;
+    uint32_t length = (uint32_t) (sizeof(spill_record) + strlen(key) + data_len + type_len);
+
+    mutex_lock(&s->queue_mtx);
+    spill_pending old = map_get_spill_queue(&s->queue, key);
+    bool found = map_found(&s->queue);
+    uint64_t queued = s->queued - (found ? old.length : 0);
+    if (s->max_bytes && queued + length > s->max_bytes / 4) {
+        mutex_unlock(&s->queue_mtx);
+        return false;
+    }
+
+    spill_pending p = {.key = found ? old.key : strdup(key), .value = *value, .length = length};
+    p.value.data = memcpy(malloc(data_len + 1), value->data, data_len + 1);
+    p.value.content_type = value->content_type ? memcpy(malloc(type_len + 1), value->content_type, type_len + 1) : NULL;
+    if (found) {
+        free((char*) old.value.data);
+        free((char*) old.value.content_type);
+    }
+    map_put_spill_queue(&s->queue, p.key, p);
+    s->queued = queued + length;
+    mutex_unlock(&s->queue_mtx);
+    return true;
+}
+
+uint32_t spill_flush(struct spill* s) {
+    if (!s->path) return 0;
+    const char* key; spill_pending p;
+    uint32_t count = 0, written = 0;
+
+    // the batch stays in 'flushing' for spill_take() until it is indexed,
+    // the strings belong to 'batch' and are only read meanwhile
+    mutex_lock(&s->io);
+    mutex_lock(&s->queue_mtx);
+    spill_pending* batch = malloc((s->queue.size ? s->queue.size : 1) * sizeof(spill_pending));
+    map_foreach(&s->queue, key, p) batch[count++] = p;
+    map_term_spill_queue(&s->flushing);
+    s->flushing = s->queue;
+    map_init_spill_queue(&s->queue, 0, 0);
+    map_set_max_size(&s->queue, UINT32_MAX);
+    s->queued = 0;
+    mutex_unlock(&s->queue_mtx);
+
+    uint64_t* offsets = malloc((count ? count : 1) * sizeof(uint64_t));
+    uint32_t* lengths = malloc((count ? count : 1) * sizeof(uint32_t));
+    bool* ok = malloc((count ? count : 1) * sizeof(bool));
+    for (uint32_t i = 0; i < count; i++)
+        ok[i] = spill_write(s, batch[i].key, &batch[i].value, &offsets[i], &lengths[i]);
+
+    // entries taken or deleted meanwhile left dead records behind
+    mutex_lock(&s->mtx);
+    mutex_lock(&s->queue_mtx);
+    for (uint32_t i = 0; i < count; i++) {
+        map_get_spill_queue(&s->flushing, batch[i].key);
+        if (!map_found(&s->flushing)) ok[i] = true;
+        else if (ok[i]) spill_index(s, batch[i].key, offsets[i], lengths[i]), written++;
+        else spill_forget(s, batch[i].key);
+    }
+    map_clear_spill_queue(&s->flushing);
+    mutex_unlock(&s->queue_mtx);
+    mutex_unlock(&s->mtx);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!ok[i]) spill_dropped(s, batch[i].key);
+        spill_pending_free(&batch[i]);
+    }
+    if (s->max_bytes && s->end > s->max_bytes) spill_compact(s);
+    mutex_unlock(&s->io);
+    free(batch);
+    free(offsets);
+    free(lengths);
+    free(ok);
+    return written;
+}
+
+// Takes a queued entry over, its strings go to the caller. One being flushed
+// is copied, the flush still reads it.
+bool spill_dequeue(struct spill* s, const char* key, response_data* value) {
+    mutex_lock(&s->queue_mtx);
+    spill_pending p = map_del_spill_queue(&s->queue, key);
+    bool found = map_found(&s->queue), flushing = false;
+    if (found) s->queued -= p.length;
+    else {
+        p = map_del_spill_queue(&s->flushing, key);
+        found = flushing = map_found(&s->flushing);
+    }
+    if (flushing) {
+        p.value.data = strdup(p.value.data);
+        if (p.value.content_type) p.value.content_type = strdup(p.value.content_type);
+    }
+    mutex_unlock(&s->queue_mtx);
+
+    if (!found) return false;
+    if (!flushing) free(p.key);
+    *value = p.value;
+    return true;
+}
+
+bool spill_take(struct spill* s, const char* key, response_data* value) {
+    if (!s->path) return false;
+    spill_record rec;
+    char* buf = NULL;
+    size_t cap = 0;
+
+    if (spill_dequeue(s, key, value)) {
+        if (!value->content_type) value->content_type = calloc(1, 1);
+        return true;
+    }
+
+    // the record is ours once it is out of the index, the segment stays open
+    // until it is read
+    mutex_lock(&s->mtx);
+    spill_loc loc = map_get_spill(&s->index, key);
+    bool found = map_found(&s->index);
+    struct spill_file* f = s->file;
+    if (found) {
+        f->users++;
+        spill_forget(s, key);
+    }
+    mutex_unlock(&s->mtx);
+    if (!found) return false;
+
+    bool ok = spill_read(f->fp, loc.offset, &rec, &buf, &cap);
+    spill_file_release(s, f);
+    if (ok) {
+        char* data = malloc(rec.data_len + 1);
+        char* type = malloc(rec.type_len + 1);
+        memcpy(data, buf + rec.key_len, rec.data_len);
+        memcpy(type, buf + rec.key_len + rec.data_len, rec.type_len);
+        data[rec.data_len] = type[rec.type_len] = '\0';
+        *value = (response_data) {.data = data, .content_type = type,
+                                  .response_code = (long) rec.response_code, .time = rec.time};
+    } else spill_dropped(s, key);
+    free(buf);
+    return ok;
+}
+
+bool spill_del(struct spill* s, const char* key) {
+    if (!s->path) return false;
+    response_data queued;
+    bool found = spill_dequeue(s, key, &queued);
+    if (found) {
+        free((char*) queued.data);
+        free((char*) queued.content_type);
+    }
+
+    mutex_lock(&s->mtx);
+    map_get_spill(&s->index, key);
+    found = map_found(&s->index) || found;
+    spill_forget(s, key);
+    mutex_unlock(&s->mtx);
+    return found;
+}
+
+uint64_t spill_bytes(struct spill* s) {
+    if (!s->path) return 0;
+    mutex_lock(&s->mtx);
+    uint64_t live = s->live;
+    mutex_unlock(&s->mtx);
+    return live;
+}
@@ -0,0 +1,150 @@
+#ifndef OAUTH_SPILL_H
+#define OAUTH_SPILL_H
+
+#include <OAuth.h>
+#include <stdio.h>
+
+#define SPILL_DEFAULT_BYTES (64ull << 20)
+
+// Where a key's newest record lives in the segment file
+typedef struct spill_loc {
+    char* key;                   // owned, the index borrows it
+    uint64_t offset;
+    uint32_t length;
+} spill_loc;
+
+map_dec_strkey(spill, const char*, spill_loc)
+
+// Evicted entry waiting for spill_flush(), owns its key and strings
+typedef struct spill_pending {
+    char* key;
+    response_data value;
+    uint32_t length;
+} spill_pending;
+
+map_dec_strkey(spill_queue, const char*, spill_pending)
+
+// Segment file, kept open by the readers still using it after a compaction
+struct spill_file {
+    FILE* fp;
+    uint32_t users;              // the spill itself and every reader, under 'mtx'
+};
+
+/**
+ * Second cache tier on disk. Entries evicted from memory are appended to a
+ * segment file and found again through an in-memory index of key to offset,
+ * a hit moves the entry back to memory and leaves a dead record behind.
+ *
+ * Once the file outgrows its budget it is compacted: the live records are
+ * copied to a new file, oldest first dropped until they fit in half of the
+ * budget, which then replaces the segment. Keys dropped that way, or lost to
+ * a failed write or read, are passed to the spill_set_drop() callback.
+ *
+ * Evictions happen under a cache shard lock, so spill_defer() only queues a
+ * copy of the entry and spill_flush() does the writing and compacting from a
+ * background thread. Queued entries, and those being flushed, are found by
+ * spill_take() like written ones.
+ *
+ * Writing and compacting run under 'io' alone, 'mtx' only guards the index
+ * and is never held over the disk. A reader pins the segment it found a
+ * record in and reads that one record, so a miss never waits on a flush or a
+ * compaction.
+ *
+ * The disk tier does not survive a restart: the file is truncated on open and
+ * removed on close, saving the cache between sessions is left to the cache
+ * file. Every function is thread safe.
+ */
+struct spill {
+    struct mutex mtx;            // index and segment
+    struct spill_file* file;
+    char* path;                  // NULL when closed
+    struct map_spill index;
+    struct mutex queue_mtx;      // never held while waiting on 'mtx'
+    struct map_spill_queue queue;
+    struct map_spill_queue flushing; // being written by spill_flush()
+    uint64_t queued;             // bytes
+    struct mutex io;             // writing and compacting
+    uint64_t end;                // file size, under 'io'
+    uint64_t live;               // bytes of indexed records
+    uint64_t max_bytes;
+    uint64_t compactions;
+    void (*drop)(void* arg, const char* key);
+    void* drop_arg;
+};
+
+/**
+ * @param s         spill
+ * @param path      segment file, truncated
+ * @param max_bytes file size that triggers a compaction
+ * @return          'true' on success.
+ */
+bool spill_open(struct spill* s, const char* path, uint64_t max_bytes);
+
+/**
+ * Closes and removes the segment file, queued entries are dropped.
+ * @param s spill
+ */
+void spill_close(struct spill* s);
+
+/**
+ * Called, with no lock held, for every key the spill loses on its own: the
+ * oldest records a compaction drops and records that failed to be written or
+ * read back. Not called for keys taken or deleted.
+ * @param s   spill
+ * @param fn  callback, NULL for none
+ * @param arg passed to 'fn'
+ */
+void spill_set_drop(struct spill* s, void (*fn)(void* arg, const char* key), void* arg);
+
+/**
+ * Append an entry, it replaces an older record of the same key.
+ * @param s     spill
+ * @param key   key
+ * @param value value
+ * @return      'true' on success.
+ */
+bool spill_put(struct spill* s, const char* key, const response_data* value);
+
+/**
+ * Queue an entry for the next spill_flush(), it replaces a queued entry of the
+ * same key. Never touches the file.
+ * @param s     spill
+ * @param key   key
+ * @param value value, copied
+ * @return      'false' if there is no file or the queue is over a quarter of
+ *              the budget.
+ */
+bool spill_defer(struct spill* s, const char* key, const response_data* value);
+
+/**
+ * Append the queued entries, compacting the file when it outgrows its budget.
+ * @param s spill
+ * @return  entries written
+ */
+uint32_t spill_flush(struct spill* s);
+
+/**
+ * Look a key up, queued or written, and drop it.
+ * @param s     spill
+ * @param key   key
+ * @param value set on success, 'data' and 'content_type' are allocated and
+ *              owned by the caller.
+ * @return      'true' if the key was found and read back.
+ */
+bool spill_take(struct spill* s, const char* key, response_data* value);
+
+/**
+ * Drop a key from the index, its record is reclaimed by the next compaction.
+ * @param s   spill
+ * @param key key
+ * @return    'true' if the key was spilled.
+ */
+bool spill_del(struct spill* s, const char* key);
+
+/**
+ * @param s spill
+ * @return  bytes of live records
+ */
+uint64_t spill_bytes(struct spill* s);
+
+#endif
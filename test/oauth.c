@@ -0,0 +1,404 @@
+#define _UTILS_IMPL
+#include <OAuth.h>
+#include <server.h>
+#include <cache.h>
+#include <journal.h>
+#include <snapshot.h>
+#include <spill.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tests of oauth_request against the loopback server and of the cache tiers
+// underneath it. Every test starts from a fresh OAuth, files are created in
+// the working directory and removed again.
+
+#define CHUNKED_BODY "{\"chunked\":\"0123456789abcdef0123456789abcdef\"}"
+#define SPILL_KEYS 64
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static int failures;
+
+static bool check(bool ok, const char* what, int line) {
+    if (!ok) {
+        fprintf(stderr, "test/oauth.c:%d: %s\n", line, what);
+        failures++;
+    } return ok;
+}
+
+static response_data get(OAuth* oauth, struct server* s, const char* path, uint8_t options) {
+    char* url = server_url(s, path);
+    oauth_set_options(oauth, options);
+    response_data response = oauth_request(oauth, GET, url);
+    str_destroy(&url);
+    return response;
+}
+
+static void release(response_data response) {
+    free((char*) response.data);
+    free((char*) response.content_type);
+}
+
+static uint64_t counter(OAuth* oauth, STAT stat) {
+    oauth_stats stats;
+    oauth_get_stats(oauth, &stats);
+    return stats.counters[stat];
+}
+
+static BREAKER breaker_state(OAuth* oauth, struct server* s) {
+    char* url = server_url(s, "/");
+    BREAKER state = oauth_breaker(oauth, url).state;
+    str_destroy(&url);
+    return state;
+}
+
+static long file_size(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return -1;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// Chunked bodies are reassembled and only a 200 is cached, whatever else the
+// upstream answers goes to the caller and is asked for again next time.
+// Retry-After is not interpreted, a 429 is only counted.
+static void test_routes(struct server* s) {
+    OAuth* oauth = oauth_create(NULL);
+    response_data response;
+
+    for (int i = 0; i < 2; i++) {
+        response = get(oauth, s, "/chunked", REQUEST_CACHE);
+        CHECK(response.response_code == 200 && response.data && !strcmp(response.data, CHUNKED_BODY));
+        release(response);
+    }
+    CHECK(server_hits(s, "/chunked") == 1);
+
+    const char* paths[] = {"/not-modified", "/throttled", "/error"};
+    const long codes[] = {304, 429, 500};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 2; j++) {
+            response = get(oauth, s, paths[i], REQUEST_CACHE);
+            CHECK(response.response_code == codes[i]);
+            release(response);
+        }
+        CHECK(server_hits(s, paths[i]) == 2);
+    }
+
+    oauth_stats stats;
+    oauth_get_stats(oauth, &stats);
+    CHECK(stats.requests[GET][STATUS_2XX] == 1);
+    CHECK(stats.requests[GET][STATUS_3XX] == 2);
+    CHECK(stats.requests[GET][STATUS_4XX] == 2);
+    CHECK(stats.requests[GET][STATUS_5XX] == 2);
+    CHECK(stats.counters[CACHE_HITS] == 1);
+    oauth_delete(oauth);
+}
+
+// The code is traded for a token pair, the refresh token for the next one
+static void test_token(struct server* s) {
+    OAuth* oauth = oauth_create(NULL);
+    char* url = server_url(s, "/oauth/token");
+    uint64_t before = server_hits(s, "/oauth/token");
+    oauth_set_param(oauth, CLIENT_ID, "client");
+    oauth_set_param(oauth, TOKEN_URL, url);
+
+    oauth_auth(oauth, "code");
+    CHECK(server_hits(s, "/oauth/token") == before + 1);
+    CHECK(oauth_start_refresh(oauth, 0));
+    CHECK(server_hits(s, "/oauth/token") == before + 2);
+    CHECK(counter(oauth, TOKEN_REFRESHES) == 1 && counter(oauth, TOKEN_REFRESH_FAILURES) == 0);
+
+    oauth_delete(oauth);
+    str_destroy(&url);
+}
+
+// Two 5xx in a row open the breaker, after the cooldown a single probe goes
+// through: a failed one opens it again, a good one closes it.
+static void test_breaker(struct server* s) {
+    OAuth* oauth = oauth_create(NULL);
+    response_data response;
+    oauth_set_param(oauth, BREAKER_THRESHOLD, "2");
+    oauth_set_param(oauth, BREAKER_COOLDOWN, "50");
+    oauth_load(oauth);
+
+    for (int i = 0; i < 2; i++)
+        release(get(oauth, s, "/flaky", 0));
+    CHECK(breaker_state(oauth, s) == BREAKER_OPEN);
+
+    response = get(oauth, s, "/flaky", 0);
+    CHECK(!response.data && counter(oauth, BREAKER_REJECTS) == 1);
+    CHECK(server_hits(s, "/flaky") == 2);
+
+    time_sleep(60);
+    release(get(oauth, s, "/flaky", 0));
+    CHECK(server_hits(s, "/flaky") == 3);
+    CHECK(breaker_state(oauth, s) == BREAKER_OPEN);
+
+    time_sleep(60);
+    server_update(s, (struct server_route) {.path = "/flaky", .body = "{\"flaky\":false}"});
+    response = get(oauth, s, "/flaky", 0);
+    CHECK(response.response_code == 200);
+    release(response);
+    CHECK(breaker_state(oauth, s) == BREAKER_CLOSED);
+
+    release(get(oauth, s, "/flaky", 0));
+    CHECK(server_hits(s, "/flaky") == 5);
+    oauth_delete(oauth);
+}
+
+// Speeds the route up once the first request is stuck in its latency
+static void* hedge_unstall(void* arg) {
+    struct server* s = (struct server*) arg;
+    for (int i = 0; i < 1000 && server_hits(s, "/hedge") == 0; i++)
+        time_sleep(1);
+    server_update(s, (struct server_route) {.path = "/hedge", .body = "{\"hedge\":true}"});
+    return NULL;
+}
+
+// The first request stalls, the hedge sent after the delay answers first
+static void test_hedge(struct server* s) {
+    OAuth* oauth = oauth_create(NULL);
+    struct thread th;
+    oauth_set_param(oauth, HEDGE_DELAY, "30");
+    oauth_load(oauth);
+
+    thread_init(&th);
+    thread_start(&th, hedge_unstall, s);
+    uint64_t start = time_mono_ms();
+    response_data response = get(oauth, s, "/hedge", REQUEST_HEDGE);
+    uint64_t elapsed = time_mono_ms() - start;
+    thread_join(&th, NULL);
+
+    CHECK(response.response_code == 200 && response.data && !strcmp(response.data, "{\"hedge\":true}"));
+    CHECK(counter(oauth, HEDGES_SENT) == 1 && counter(oauth, HEDGES_WON) == 1);
+    CHECK(elapsed < 500);
+    release(response);
+    oauth_delete(oauth);
+}
+
+// Prefixes match whole segments, "/anime/1" is not a prefix of "/anime/12"
+static void test_prefix(struct server* s) {
+    OAuth* oauth = oauth_create(NULL);
+    const char* paths[] = {"/anime/1", "/anime/12", "/anime/1/stats"};
+    for (int i = 0; i < 3; i++)
+        release(get(oauth, s, paths[i], REQUEST_CACHE));
+
+    char* prefix = server_url(s, "/anime/1");
+    CHECK(oauth_cache_invalidate_prefix(oauth, prefix) == 2);
+    str_destroy(&prefix);
+
+    for (int i = 0; i < 3; i++)
+        release(get(oauth, s, paths[i], REQUEST_CACHE));
+    CHECK(server_hits(s, "/anime/1") == 2);
+    CHECK(server_hits(s, "/anime/12") == 1);
+    CHECK(server_hits(s, "/anime/1/stats") == 2);
+
+    prefix = server_url(s, "/anime/");
+    CHECK(oauth_cache_invalidate_prefix(oauth, prefix) == 3);
+    str_destroy(&prefix);
+    CHECK(counter(oauth, CACHE_INVALIDATIONS) == 5);
+    oauth_delete(oauth);
+}
+
+// A lazily loaded snapshot serves a miss from the mapping without going
+// upstream, the record then lives in the cache.
+static void test_lazy(struct server* s) {
+    const char* path = "test-lazy.cache";
+    char* url = server_url(s, "/lazy");
+    char* key = str_create_fmt("/GET/%s", url);
+    struct cache cache;
+
+    cache_init(&cache, 16, POLICY_CLOCK);
+    cache_put(&cache, key, (response_data) {.data = "{\"from\":\"snapshot\"}", .content_type = "application/json", .response_code = 200});
+    CHECK(snapshot_write(&cache, NULL, path));
+    cache_term(&cache);
+
+    OAuth* oauth = oauth_create(NULL);
+    oauth_set_param(oauth, CACHE_FILE, (char*) path);
+    oauth_set_param(oauth, CACHE_LAZY_LOAD, "true");
+    oauth_load(oauth);
+
+    for (int i = 0; i < 2; i++) {
+        response_data response = get(oauth, s, "/lazy", REQUEST_CACHE);
+        CHECK(response.data && !strcmp(response.data, "{\"from\":\"snapshot\"}"));
+        release(response);
+    }
+    CHECK(counter(oauth, CACHE_FAULTS) == 1 && counter(oauth, CACHE_HITS) == 2);
+    CHECK(server_hits(s, "/lazy") == 0);
+    oauth_delete(oauth);
+
+    remove(path);
+    remove("test-lazy.cache.journal");
+    str_destroy(&key);
+    str_destroy(&url);
+}
+
+static void count_live(void* arg, const char* key, const response_data* value) {
+    (*(uint32_t*) arg)++;
+}
+
+// Every record is taken at most once, and consumed ones are left out of the
+// next snapshot written on top of it
+static void test_snapshot(struct server* s) {
+    const char* path = "test-snapshot.cache";
+    const char* next = "test-snapshot.cache.next";
+    const char* keys[] = {"a", "b", "c"};
+    struct cache cache;
+    struct snapshot snap = {0}, written = {0};
+    response_data value;
+    uint32_t live = 0;
+
+    cache_init(&cache, 16, POLICY_CLOCK);
+    for (int i = 0; i < 3; i++)
+        cache_put(&cache, keys[i], (response_data) {.data = keys[i], .response_code = 200});
+    CHECK(snapshot_write(&cache, NULL, path));
+    cache_term(&cache);
+
+    CHECK(snapshot_open(&snap, path));
+    CHECK(snapshot_take(&snap, "a", &value) && !strcmp(value.data, "a"));
+    CHECK(!snapshot_take(&snap, "a", &value));
+    CHECK(snapshot_find(&snap, "a", &value));
+    snapshot_consume(&snap, "b");
+    snapshot_foreach_live(&snap, count_live, &live);
+    CHECK(live == 1);
+
+    cache_init(&cache, 16, POLICY_CLOCK);
+    CHECK(snapshot_write(&cache, &snap, next));
+    cache_term(&cache);
+    CHECK(snapshot_open(&written, next));
+    CHECK(snapshot_find(&written, "c", &value) && !strcmp(value.data, "c"));
+    CHECK(!snapshot_find(&written, "a", &value) && !snapshot_find(&written, "b", &value));
+
+    snapshot_close(&written);
+    snapshot_close(&snap);
+    remove(path);
+    remove(next);
+}
+
+// The records before a torn one are replayed, then the journal is folded
+// into a snapshot and started over
+static void test_journal(struct server* s) {
+    const char* path = "test-journal.cache";
+    const char* log = "test-journal.cache.journal";
+    struct cache cache;
+    struct journal journal;
+    struct snapshot snap = {0};
+    response_data value = {.data = "{\"b\":1}", .content_type = "application/json", .response_code = 200};
+
+    remove(path);
+    remove(log);
+    cache_init(&cache, 16, POLICY_CLOCK);
+    CHECK(journal_open(&journal, &cache, NULL, path, JOURNAL_DEFAULT_RATIO));
+    journal_put(&journal, "a", &value);
+    journal_put(&journal, "b", &value);
+    journal_del(&journal, "a");
+    journal_close(&journal);
+    cache_term(&cache);
+
+    // a crash in the middle of the next record
+    FILE* fp = fopen(log, "ab");
+    journal_record torn = {.op = JOURNAL_PUT, .key_len = 4, .data_len = 64};
+    CHECK(fp && fwrite(&torn, sizeof(torn), 1, fp) == 1 && fwrite("torn", 1, 4, fp) == 4);
+    if (fp) fclose(fp);
+
+    cache_init(&cache, 16, POLICY_CLOCK);
+    CHECK(journal_open(&journal, &cache, NULL, path, JOURNAL_DEFAULT_RATIO));
+    CHECK(cache_peek(&cache, "b", &value) && !strcmp(value.data, "{\"b\":1}"));
+    CHECK(!cache_peek(&cache, "a", &value) && !cache_peek(&cache, "torn", &value));
+    CHECK(file_size(log) == 0);
+    CHECK(snapshot_open(&snap, path) && snapshot_find(&snap, "b", &value) && !snapshot_find(&snap, "a", &value));
+
+    snapshot_close(&snap);
+    journal_close(&journal);
+    cache_term(&cache);
+    remove(path);
+    remove(log);
+}
+
+static void count_drop(void* arg, const char* key) {
+    (*(uint32_t*) arg)++;
+}
+
+// Compaction keeps the newest records within half the budget and reports
+// every key it drops, the rest still read back intact
+static void test_spill(struct server* s) {
+    struct spill spill = {0};
+    char key[32], body[256];
+    uint32_t dropped = 0, taken = 0;
+    response_data value;
+
+    CHECK(spill_open(&spill, "test.spill", 4096));
+    spill_set_drop(&spill, count_drop, &dropped);
+    for (int i = 0; i < SPILL_KEYS; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(body, sizeof(body), "{\"key\":\"%s\",\"pad\":\"%0160d\"}", key, i);
+        CHECK(spill_put(&spill, key, &(response_data) {.data = body, .content_type = "application/json"}));
+    }
+    CHECK(spill.compactions > 0 && dropped > 0);
+    CHECK(spill_bytes(&spill) <= 4096);
+
+    for (int i = 0; i < SPILL_KEYS; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        snprintf(body, sizeof(body), "{\"key\":\"%s\",\"pad\":\"%0160d\"}", key, i);
+        if (!spill_take(&spill, key, &value)) {
+            CHECK(i < SPILL_KEYS - 1);
+            continue;
+        }
+        CHECK(!strcmp(value.data, body));
+        release(value);
+        taken++;
+    }
+    CHECK(taken + dropped == SPILL_KEYS);
+    CHECK(!spill_take(&spill, "k0", &value));
+    spill_close(&spill);
+}
+
+static const struct {
+    const char* name;
+    void (*fn)(struct server* s);
+} tests[] = {
+    {"routes", test_routes},
+    {"token", test_token},
+    {"breaker", test_breaker},
+    {"hedge", test_hedge},
+    {"prefix", test_prefix},
+    {"lazy", test_lazy},
+    {"snapshot", test_snapshot},
+    {"journal", test_journal},
+    {"spill", test_spill}
+};
+
+int main(int argc, char** argv) {
+    struct server s = {0};
+
+    server_route(&s, (struct server_route) {.path = "/chunked", .body = CHUNKED_BODY, .chunk_size = 8, .chunk_delay_ms = 5});
+    server_route(&s, (struct server_route) {.path = "/not-modified", .status = 304});
+    server_route(&s, (struct server_route) {.path = "/throttled", .status = 429, .headers = "Retry-After: 1\r\n", .body = "{\"error\":\"throttled\"}"});
+    server_route(&s, (struct server_route) {.path = "/error", .status = 500, .body = "{\"error\":\"internal\"}"});
+    server_route(&s, (struct server_route) {.path = "/oauth/token", .token = true});
+    server_route(&s, (struct server_route) {.path = "/flaky", .status = 503, .body = "{\"flaky\":true}"});
+    server_route(&s, (struct server_route) {.path = "/hedge", .body = "{\"hedge\":false}", .latency_ms = 1000});
+    server_route(&s, (struct server_route) {.path = "/anime/1", .body = "{\"id\":1}"});
+    server_route(&s, (struct server_route) {.path = "/anime/12", .body = "{\"id\":12}"});
+    server_route(&s, (struct server_route) {.path = "/anime/1/stats", .body = "{\"id\":1,\"stats\":{}}"});
+    server_route(&s, (struct server_route) {.path = "/lazy", .body = "{\"from\":\"upstream\"}"});
+    if (!server_start(&s, 0)) {
+        fprintf(stderr, "could not start the loopback server\n");
+        return 1;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+        tests[i].fn(&s);
+        printf("%-10s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+        failed += failures != before;
+    }
+
+    server_stop(&s);
+    return failed ? 1 : 0;
+}